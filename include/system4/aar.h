@@ -36,6 +36,13 @@ struct aar_entry {
 	char *link_target;  // points inside aar_archive.index_buf
 };
 
+struct aar_data {
+	struct archive_data super;
+	// data is shared with the archive's decompressed-entry cache
+	bool cached;
+	int cache_key;
+};
+
 struct aar_archive {
 	struct archive ar;
 	char *filename;
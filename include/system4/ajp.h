@@ -25,5 +25,6 @@ struct cg;
 
 bool ajp_checkfmt(const uint8_t *data);
 void ajp_extract(const uint8_t *data, size_t size, struct cg *cg);
+void ajp_extract_scaled(const uint8_t *data, size_t size, struct cg *cg, int max_w, int max_h);
 
 #endif /* SYSTEM4_AJP_H */
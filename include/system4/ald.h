@@ -30,6 +30,17 @@
 #define ALD_FILEMAX 255
 #define ALD_DATAMAX 65535
 
+struct hash_table;
+
+// preloaded entry header
+struct ald_entry {
+	int dataptr;  // 0 if there is no entry for this ID
+	int hdr_size;
+	uint32_t size;
+	uint32_t name_off;  // offset into ald_archive.names
+	uint8_t disk;
+};
+
 struct ald_archive {
 	struct archive ar;
 	int nr_files;
@@ -51,6 +62,13 @@ struct ald_archive {
 	int *fileptr[ALD_FILEMAX];
 	// filename conv function
 	char *(*conv)(const char*);
+	// name -> ID and basename -> ID (built on first lookup by name)
+	struct hash_table *name_index;
+	struct hash_table *basename_index;
+	// entry headers indexed by ID (NULL if opened with ARCHIVE_LAZY_INDEX)
+	struct ald_entry *entries;
+	// entry names; descriptor names point inside this buffer when preloaded
+	char *names;
 };
 
 struct ald_archive_data {
@@ -20,6 +20,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdio.h>
 
 enum ald_error {
 	ARCHIVE_SUCCESS,
@@ -29,13 +30,36 @@ enum ald_error {
 };
 
 enum {
-	ARCHIVE_MMAP = 1
+	ARCHIVE_MMAP = 1,
+	// Cache the decoded file table in a sidecar file (AFA v3 only).
+	ARCHIVE_CACHE_INDEX = 2,
+	// Read entry headers on demand instead of at open time (ALD only).
+	ARCHIVE_LAZY_INDEX = 4,
 };
 
+/*
+ * Thread safety: `archive_exists`, `archive_get`, `archive_load_file`,
+ * `archive_release_file` and `archive_free_data` may be called concurrently
+ * on the same archive (with distinct descriptors), whether or not the archive
+ * is memory-mapped. Non-mmapped archives use positional reads and never
+ * depend on a shared file position. The same goes for lookups by name or
+ * basename (`archive_exists_by_name`, `archive_get_by_basename` etc.), which
+ * may build an index on first use.
+ */
+
+struct archive_cache;
+struct archive_stream;
+struct hash_table;
+
 struct archive {
 	bool mmapped;
 	struct archive_ops *ops;
 	struct string *(*conv)(const char*,size_t);
+	struct archive_cache *cache;
+	// per-archive state of a higher layer, freed with `free_user_cache`
+	// when the archive is freed
+	void *user_cache;
+	void (*free_user_cache)(void *user_cache);
 };
 
 struct archive_ops {
@@ -47,6 +71,8 @@ struct archive_ops {
 	struct archive_data *(*get_by_basename)(struct archive *ar, const char *name);
 	bool (*load_file)(struct archive_data *file);
 	void (*release_file)(struct archive_data *file);
+	bool (*read_range)(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+	struct archive_stream *(*open_stream)(struct archive *ar, int no);
 	struct archive_data *(*copy_descriptor)(struct archive_data *src);
 	void (*for_each)(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 	void (*free_data)(struct archive_data *data);
@@ -135,6 +161,86 @@ static inline void archive_release_file(struct archive_data *data)
 		_archive_release_file(data);
 }
 
+/*
+ * Read up to `len` bytes starting at offset `off` of a file into `buf`,
+ * without loading the rest of the file. The number of bytes read is stored in
+ * `nread`; it is less than `len` only if the file ends first. Compressed
+ * entries are only inflated as far as needed. Archives without support for
+ * partial reads fall back to loading the whole file.
+ */
+bool archive_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+
+/*
+ * Read the first `len` bytes of a file (see `archive_read_range`).
+ */
+static inline bool archive_peek(struct archive *ar, int no, uint8_t *buf, size_t len, size_t *nread)
+{
+	return archive_read_range(ar, no, 0, len, buf, nread);
+}
+
+struct archive_stream_ops {
+	bool (*read)(struct archive_stream *s, uint8_t *buf, size_t len, size_t *nread);
+	bool (*seek)(struct archive_stream *s, size_t pos);
+	void (*close)(struct archive_stream *s);
+};
+
+struct archive_stream {
+	struct archive_stream_ops *ops;
+	struct archive *archive;
+	int no;
+	size_t size;  // (uncompressed) size of the file
+	size_t pos;
+};
+
+/*
+ * Open a file for sequential reading. Data is read from the archive in chunks
+ * as it is requested, and compressed entries are inflated incrementally, so
+ * memory use doesn't depend on the size of the file. Archives without support
+ * for streaming load the whole file up front.
+ *
+ * A stream may be used concurrently with other streams and descriptors of the
+ * same archive, but not from several threads at once.
+ */
+struct archive_stream *archive_open_stream(struct archive *ar, int no);
+
+/*
+ * Read up to `len` bytes from the current position of a stream. The number of
+ * bytes read is stored in `nread`; it is 0 at the end of the file.
+ */
+bool archive_stream_read(struct archive_stream *s, void *buf, size_t len, size_t *nread);
+
+/*
+ * Set the position of a stream. `whence` is one of SEEK_SET, SEEK_CUR or
+ * SEEK_END. Seeking backwards in a compressed entry restarts inflation from
+ * the beginning of the entry.
+ */
+bool archive_stream_seek(struct archive_stream *s, int64_t offset, int whence);
+
+static inline size_t archive_stream_tell(struct archive_stream *s)
+{
+	return s->pos;
+}
+
+static inline size_t archive_stream_size(struct archive_stream *s)
+{
+	return s->size;
+}
+
+void archive_stream_close(struct archive_stream *s);
+
+/*
+ * Open a stream reading `size` bytes at offset `off` of a file, or of a memory
+ * mapping if `map` is not NULL. For use by archive implementations.
+ */
+struct archive_stream *_archive_open_file_stream(struct archive *ar, int no, FILE *f,
+		const uint8_t *map, size_t off, size_t size);
+
+/*
+ * Open a stream over a loaded descriptor, which is freed when the stream is
+ * closed. For use by archive implementations.
+ */
+struct archive_stream *_archive_open_data_stream(struct archive_data *data);
+
 /*
  * Copy a descriptor. This should be used in conjunction with `archive_for_each`
  * when descriptors will escape the iterator. A descriptor copied with this
@@ -161,6 +267,31 @@ static inline void archive_for_each(struct archive *ar, void (*iter)(struct arch
 		ar->ops->for_each(ar, iter, user);
 }
 
+enum archive_entry_status {
+	ARCHIVE_ENTRY_OK,
+	ARCHIVE_ENTRY_LOAD_ERROR,
+	ARCHIVE_ENTRY_ITER_ERROR,
+};
+
+struct archive_for_each_result {
+	int no;
+	enum archive_entry_status status;
+};
+
+/*
+ * Like `archive_for_each`, but descriptors are handed out to a pool of
+ * `nr_threads` workers (including the calling thread). Each descriptor is
+ * loaded before `iter` is called and released after it returns; `iter`
+ * returns false to signal an error for that entry.
+ *
+ * Returns the number of entries visited. If `results_out` is not NULL, it
+ * receives a malloc'd array holding the ID and status of each entry, in the
+ * same order that `archive_for_each` would have visited them.
+ */
+size_t archive_for_each_parallel(struct archive *ar, int nr_threads,
+		bool (*iter)(struct archive_data *data, void *user), void *user,
+		struct archive_for_each_result **results_out);
+
 /*
  * Free an archive_data structure returned by `archive_get`.
  */
@@ -172,11 +303,59 @@ static inline void archive_free_data(struct archive_data *data)
 /*
  * Free an ald_archive structure returned by `ald_open`.
  */
+void _archive_free_cache(struct archive *ar);
 static inline void archive_free(struct archive *ar)
 {
+	if (ar->cache)
+		_archive_free_cache(ar);
+	if (ar->free_user_cache)
+		ar->free_user_cache(ar->user_cache);
 	ar->ops->free(ar);
 }
 
+struct archive_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t nr_entries;
+	size_t bytes;
+	size_t budget;
+};
+
+/*
+ * Enable caching of decompressed entries (AAR and FLAT only). Up to `budget`
+ * bytes of inflated data are kept around after being released, and evicted
+ * in least-recently-used order. Descriptors loading the same entry share one
+ * buffer, which must not be modified. Entries larger than `budget` are never
+ * cached. Calling this again changes the budget, evicting entries as needed.
+ */
+void archive_enable_cache(struct archive *ar, size_t budget);
+
+/*
+ * Get cache counters. Returns false if caching is not enabled.
+ */
+bool archive_get_cache_stats(struct archive *ar, struct archive_cache_stats *out);
+
+/*
+ * Interface for archive implementations. `_archive_cache_get` returns a
+ * referenced buffer (or NULL on a miss); `_archive_cache_put` takes ownership
+ * of `data` and returns the referenced shared buffer, or NULL if the entry
+ * can't be cached (in which case ownership stays with the caller). Every
+ * non-NULL return must be paired with `_archive_cache_release`, passing the
+ * returned buffer.
+ */
+uint8_t *_archive_cache_get(struct archive *ar, int key, size_t *size_out);
+uint8_t *_archive_cache_put(struct archive *ar, int key, uint8_t *data, size_t size);
+void _archive_cache_release(struct archive *ar, int key, uint8_t *data);
+
+/*
+ * Interface for archive implementations that build lookup indices on first
+ * use. Returns `*index`, creating it with `build` if this is the first call.
+ * Concurrent callers wait for a single build.
+ */
+struct hash_table *_archive_lazy_index(struct archive *ar, struct hash_table **index,
+		struct hash_table *(*build)(struct archive *ar));
+
 struct archive_data *_archive_make_descriptor(struct archive *ar, char *name, int no, size_t size);
 
 char *archive_basename(const char *name);
@@ -43,6 +43,15 @@ enum cg_type {
 	_ALCG_NR_FORMATS
 };
 
+/*
+ * Pixel layouts for cg_load_into
+ */
+enum cg_pixel_format {
+	CG_PIXEL_RGBA,
+	CG_PIXEL_BGRA,
+	CG_PIXEL_RGBA_PREMULTIPLIED,
+};
+
 struct cg_metrics {
 	int x;
 	int y;
@@ -55,6 +64,20 @@ struct cg_metrics {
 	int alpha_pitch;
 };
 
+/*
+ * Alpha channel statistics of decoded CG data
+ */
+struct cg_alpha_info {
+	bool opaque;      // every pixel has alpha 255
+	bool transparent; // every pixel has alpha 0
+	bool binary;      // every pixel has alpha 0 or 255
+	// bounding box of the pixels with non-zero alpha (empty if transparent)
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
 /*
  * Information for displaying CG data
  */
@@ -62,6 +85,9 @@ struct cg {
 	enum cg_type type; // cg format type
 	struct cg_metrics metrics;
 	void *pixels;
+	// set if alpha_info is valid (see cg_get_alpha_info)
+	bool has_alpha_info;
+	struct cg_alpha_info alpha_info;
 };
 
 extern const char *cg_file_extensions[_ALCG_NR_FORMATS];
@@ -73,6 +99,16 @@ static inline const char *cg_file_extension(enum cg_type t)
 	return cg_file_extensions[t];
 }
 
+struct qnt_write_options;
+
+/*
+ * Options for cg_encode. A NULL pointer selects the encoder's defaults (the
+ * same as cg_write).
+ */
+struct cg_encode_options {
+	const struct qnt_write_options *qnt;
+};
+
 struct archive_data;
 
 enum cg_type cg_check_format(uint8_t *data);
@@ -82,7 +118,76 @@ struct cg *cg_load_data(struct archive_data *dfile);
 struct cg *cg_load(struct archive *ar, int no);
 struct cg *cg_load_file(const char *filename);
 struct cg *cg_load_buffer(uint8_t *buf, size_t buf_size);
+void cg_crop(struct cg *cg, int x, int y, int w, int h);
+struct cg *cg_load_rect(uint8_t *buf, size_t buf_size, int x, int y, int w, int h);
+struct cg *cg_load_data_rect(struct archive_data *dfile, int x, int y, int w, int h);
+void cg_get_scaled_size(int w, int h, int max_w, int max_h, int *w_out, int *h_out);
+struct cg *cg_load_scaled(struct archive *ar, int no, int max_w, int max_h);
+struct cg *cg_load_data_scaled(struct archive_data *dfile, int max_w, int max_h);
+bool cg_load_data_into(struct archive_data *dfile, uint8_t *dst, size_t dst_size, size_t stride,
+		enum cg_pixel_format fmt);
+bool cg_load_into(uint8_t *buf, size_t buf_size, uint8_t *dst, size_t dst_size, size_t stride,
+		enum cg_pixel_format fmt);
 int cg_write(struct cg *cg, enum cg_type type, FILE *f);
+bool cg_encode(struct cg *cg, enum cg_type type, const struct cg_encode_options *opts,
+		uint8_t **buf, size_t *size);
+uint8_t *cg_write_buffer(struct cg *cg, enum cg_type type, size_t *size);
 void cg_free(struct cg *cg);
 
+/*
+ * Collect alpha statistics while decoding CGs (off by default). Decoders that
+ * produce alpha values row by row then look at each row while it is still in
+ * cache, and formats without an alpha channel are known to be opaque without
+ * looking at the pixels at all.
+ *
+ * The setting only applies to CGs decoded on the calling thread, so callbacks
+ * of archive_for_each_parallel must make it themselves. It only affects when
+ * the statistics are computed: cg_get_alpha_info returns the same result
+ * either way.
+ */
+void cg_set_collect_alpha_info(bool enable);
+
+/*
+ * Get alpha statistics for a decoded CG. If they weren't collected while
+ * decoding, the pixels are scanned once and the result is kept with the CG.
+ * Code that modifies the pixels of a CG must clear `has_alpha_info`.
+ */
+const struct cg_alpha_info *cg_get_alpha_info(struct cg *cg);
+
+struct cg_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t nr_entries;
+	size_t bytes;
+	size_t budget;
+};
+
+/*
+ * Enable caching of decoded base CGs (the CGs that DCF diffs and WebP
+ * overlays are composed onto) for an archive. Up to `budget` bytes of pixel
+ * data are kept around after use, and evicted in least-recently-used order.
+ * The cache is freed along with the archive.
+ *
+ * CGs of the same archive (with or without the cache) may be decoded on
+ * several threads at once, e.g. from archive_for_each_parallel: base CGs are
+ * found by basename, and archive lookups are thread-safe. The cache must be
+ * enabled before decoding starts, but its budget may be changed at any time.
+ */
+void cg_enable_base_cache(struct archive *ar, size_t budget);
+
+/*
+ * Get base CG cache counters. Returns false if caching is not enabled.
+ */
+bool cg_get_base_cache_stats(struct archive *ar, struct cg_cache_stats *out);
+
+/*
+ * Interface for decoders. `_cg_load_base` returns a base CG, which is shared
+ * and must not be modified, or NULL if it can't be loaded or is already being
+ * decoded further up the chain. Every non-NULL return must be paired with
+ * `_cg_release_base`.
+ */
+struct cg *_cg_load_base(struct archive *ar, int no);
+void _cg_release_base(struct archive *ar, int no, struct cg *cg);
+
 #endif /* SYSTEM4_CG_H */
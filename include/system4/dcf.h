@@ -27,6 +27,8 @@ struct archive;
 
 bool dcf_checkfmt(const uint8_t *data);
 void dcf_extract(const uint8_t *data, size_t size, struct cg *cg, struct archive *ar);
+bool dcf_extract_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr,
+		struct archive *ar);
 void dcf_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *m);
 
 #endif /* SYSTEM4_DCF_H */
@@ -43,6 +43,7 @@ int remove_utf8(const char *path);
 int rmdir_utf8(const char *path);
 FILE *file_open_utf8(const char *path, const char *mode);
 void *file_read(const char *path, size_t *len_out);
+bool file_pread(FILE *f, void *buf, size_t size, off_t off);
 bool file_write(const char *path, uint8_t *data, size_t data_size);
 bool file_copy(const char *src, const char *dst);
 bool file_exists(const char *path);
@@ -59,6 +59,8 @@ struct flat_data {
 	size_t size;
 	enum flat_data_type type;
 	bool inflated;
+	// inflated data is shared with the archive's decompressed-entry cache
+	bool cached;
 };
 
 struct flat_section {
@@ -27,5 +27,9 @@ struct cg_metrics;
 bool jpeg_cg_checkfmt(const uint8_t *data);
 bool jpeg_cg_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *dst);
 void jpeg_cg_extract(const uint8_t *data, size_t size, struct cg *cg);
+void jpeg_cg_extract_rect(const uint8_t *data, size_t size, struct cg *cg, int x, int y, int w, int h);
+void jpeg_cg_extract_scaled(const uint8_t *data, size_t size, struct cg *cg, int max_w, int max_h);
+void jpeg_get_decode_size(int w, int h, int max_w, int max_h, int *w_out, int *h_out);
+bool jpeg_cg_extract_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr);
 
 #endif /* SYSTEM4_JPEG_H */
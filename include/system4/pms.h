@@ -28,6 +28,7 @@ bool pms8_checkfmt(const uint8_t *data);
 bool pms16_checkfmt(const uint8_t *data);
 bool pms_get_metrics(const uint8_t *data, struct cg_metrics *dst);
 void pms_extract(const uint8_t *data, size_t size, struct cg *cg);
+void pms_extract_rect(const uint8_t *data, size_t size, struct cg *cg, int x, int y, int w, int h);
 uint8_t *pms_extract_mask(const uint8_t *data, size_t size);
 
 #endif /* SYSTEM4_PMS_H */
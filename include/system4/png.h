@@ -22,12 +22,16 @@
 #include <stdint.h>
 #include <stdio.h>
 
+struct buffer;
 struct cg;
 struct cg_metrics;
 
 bool png_cg_checkfmt(const uint8_t *data);
 bool png_cg_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *dst);
 void png_cg_extract(const uint8_t *data, size_t size, struct cg *cg);
+void png_cg_extract_rect(const uint8_t *data, size_t size, struct cg *cg, int x, int y, int w, int h);
+bool png_cg_extract_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr);
 int png_cg_write(struct cg *cg, FILE *f);
+int png_cg_encode(struct cg *cg, struct buffer *out);
 
 #endif /* SYSTEM4_PNG_H */
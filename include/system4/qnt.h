@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <stdio.h>
 
+struct buffer;
 struct cg;
 struct cg_metrics;
 
@@ -45,10 +46,21 @@ struct qnt_header {
 	int alpha_size;   // compressed alpha pixel size
 };
 
+struct qnt_write_options {
+	int level;        // zlib compression level (0-9)
+	int strategy;     // zlib compression strategy (0 = Z_DEFAULT_STRATEGY)
+	int nr_threads;   // number of threads used to compress the planes
+};
+
+#define QNT_WRITE_OPTIONS_DEFAULT { .level = 9, .strategy = 0, .nr_threads = 1 }
+
 bool qnt_checkfmt(const uint8_t *data);
 bool qnt_get_metrics(const uint8_t *data, struct cg_metrics *dst);
 void qnt_extract(const uint8_t *data, struct cg *cg);
+bool qnt_extract_into(const uint8_t *data, uint8_t *dst, size_t stride, bool bgr);
 void qnt_extract_header(const uint8_t *b, struct qnt_header *qnt);
 int qnt_write(struct cg *cg, FILE *f);
+int qnt_write_with_options(struct cg *cg, FILE *f, const struct qnt_write_options *opts);
+int qnt_encode(struct cg *cg, const struct qnt_write_options *opts, struct buffer *out);
 
 #endif /* SYSTEM4_QNT_H */
@@ -22,13 +22,21 @@
 #include <stdint.h>
 #include <stdio.h>
 
+struct buffer;
 struct cg;
 struct cg_metrics;
 struct archive;
 
 bool webp_checkfmt(const uint8_t *data);
 void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar);
+void webp_extract_rect(uint8_t *data, size_t size, struct cg *cg, struct archive *ar,
+		int x, int y, int w, int h);
+void webp_extract_scaled(uint8_t *data, size_t size, struct cg *cg, struct archive *ar,
+		int max_w, int max_h);
+bool webp_extract_into(uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr,
+		struct archive *ar);
 void webp_get_metrics(uint8_t *data, size_t size, struct cg_metrics *m);
 int webp_write(struct cg *cg, FILE *f);
+int webp_encode(struct cg *cg, struct buffer *out);
 
 #endif /* SYSTEM4_WEBP_H */
@@ -53,6 +53,9 @@ static struct archive_data *aar_get(struct archive *ar, int no);
 static struct archive_data *aar_get_by_name(struct archive *ar, const char *name);
 static bool aar_load_file(struct archive_data *data);
 static void aar_release_file(struct archive_data *data);
+static bool aar_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+static struct archive_stream *aar_open_stream(struct archive *ar, int no);
+static struct archive_data *aar_copy_descriptor(struct archive_data *src);
 static void aar_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void aar_free_data(struct archive_data *data);
 static void aar_free(struct archive *ar);
@@ -64,7 +67,9 @@ struct archive_ops aar_archive_ops = {
 	.get_by_basename = NULL,
 	.load_file = aar_load_file,
 	.release_file = aar_release_file,
-	.copy_descriptor = NULL,
+	.read_range = aar_read_range,
+	.open_stream = aar_open_stream,
+	.copy_descriptor = aar_copy_descriptor,
 	.for_each = aar_for_each,
 	.free_data = aar_free_data,
 	.free = aar_free,
@@ -102,34 +107,88 @@ static bool aar_inflate_entry(struct archive_data *data, uint8_t *buf, uint32_t
 	return true;
 }
 
+static struct aar_entry *aar_resolve_symlink(struct aar_archive *ar, int no)
+{
+	struct aar_entry *e = &ar->files[no];
+	while (e->type == AAR_SYMLINK) {
+		e = ht_get_ignorecase(ar->ht, e->link_target, NULL);
+		if (!e) {
+			WARNING("orphaned symlink: %s", ar->files[no].name);
+			return NULL;
+		}
+	}
+	return e;
+}
+
+/*
+ * Look up a compressed entry in the archive's decompressed-entry cache.
+ */
+static bool aar_cache_get(struct archive_data *data, struct aar_entry *e)
+{
+	struct aar_archive *ar = (struct aar_archive*)data->archive;
+	struct aar_data *aardata = (struct aar_data*)data;
+	if (!ar->ar.cache)
+		return false;
+
+	size_t size;
+	int key = e - ar->files;
+	uint8_t *buf = _archive_cache_get(&ar->ar, key, &size);
+	if (!buf)
+		return false;
+	data->data = buf;
+	data->size = size;
+	aardata->cached = true;
+	aardata->cache_key = key;
+	return true;
+}
+
+/*
+ * Hand an inflated entry over to the archive's decompressed-entry cache.
+ */
+static void aar_cache_put(struct archive_data *data, struct aar_entry *e)
+{
+	struct aar_archive *ar = (struct aar_archive*)data->archive;
+	struct aar_data *aardata = (struct aar_data*)data;
+	if (!ar->ar.cache)
+		return;
+
+	int key = e - ar->files;
+	uint8_t *buf = _archive_cache_put(&ar->ar, key, data->data, data->size);
+	if (!buf)
+		return;
+	data->data = buf;
+	aardata->cached = true;
+	aardata->cache_key = key;
+}
+
 static bool aar_load_file(struct archive_data *data)
 {
 	if (data->data)
 		return true;
 
 	struct aar_archive *ar = (struct aar_archive*)data->archive;
-	struct aar_entry *e = &ar->files[data->no];
+	struct aar_entry *e = aar_resolve_symlink(ar, data->no);
+	if (!e)
+		return false;
 
-	while (e->type == AAR_SYMLINK) {
-		e = ht_get_ignorecase(ar->ht, e->link_target, NULL);
-		if (!e) {
-			WARNING("orphaned symlink: %s", ar->files[data->no].name);
-			return false;
-		}
-	}
+	if (e->type == AAR_COMPRESSED && aar_cache_get(data, e))
+		return true;
 
 	if (ar->ar.mmapped) {
 		uint8_t *ptr = (uint8_t *)ar->mmap_ptr + e->off;
-		if (e->type == AAR_COMPRESSED)
-			return aar_inflate_entry(data, ptr, e->size);
+		if (e->type == AAR_COMPRESSED) {
+			if (!aar_inflate_entry(data, ptr, e->size))
+				return false;
+			aar_cache_put(data, e);
+			return true;
+		}
 		data->data = ptr;
 		data->size = e->size;
 		return true;
 	}
 
-	fseek(ar->f, e->off, SEEK_SET);
 	uint8_t *buf = xmalloc(e->size);
-	if (e->size > 0 && fread(buf, e->size, 1, ar->f) != 1) {
+	if (e->size > 0 && !file_pread(ar->f, buf, e->size, e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(buf);
 		return false;
@@ -137,6 +196,8 @@ static bool aar_load_file(struct archive_data *data)
 	if (e->type == AAR_COMPRESSED) {
 		bool result = aar_inflate_entry(data, buf, e->size);
 		free(buf);
+		if (result)
+			aar_cache_put(data, e);
 		return result;
 	}
 
@@ -145,18 +206,221 @@ static bool aar_load_file(struct archive_data *data)
 	return true;
 }
 
+/*
+ * Read part of an entry's raw (possibly compressed) data.
+ */
+static bool aar_read_raw(struct aar_archive *ar, struct aar_entry *e, size_t off, size_t len, uint8_t *buf)
+{
+	if (ar->ar.mmapped) {
+		memcpy(buf, (uint8_t*)ar->mmap_ptr + e->off + off, len);
+		return true;
+	}
+	if (len && !file_pread(ar->f, buf, len, e->off + off)) {
+		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Incremental reader for ZLB compressed entries.
+ */
+struct aar_zstream {
+	struct archive_stream s;
+	struct aar_entry *e;
+	uint32_t in_size;
+	size_t in_pos;   // offset of the next compressed byte within the entry
+	size_t out_pos;  // number of bytes inflated so far
+	z_stream z;
+	uint8_t in[8192];
+};
+
+static bool aar_zstream_init(struct aar_zstream *s, struct aar_archive *ar, int no, struct aar_entry *e)
+{
+	uint8_t hdr[16];
+	if (e->size < 16 || !aar_read_raw(ar, e, 0, 16, hdr))
+		return false;
+	if (memcmp(hdr, "ZLB\0", 4))
+		return false;
+	uint32_t version = LittleEndian_getDW(hdr, 4);
+	if (version != 0) {
+		WARNING("unknown ZLB version: %u", version);
+		return false;
+	}
+	uint32_t in_size = LittleEndian_getDW(hdr, 12);
+	if (in_size + 16 > e->size) {
+		WARNING("Bad ZLB size");
+		return false;
+	}
+
+	memset(s, 0, offsetof(struct aar_zstream, in));
+	if (inflateInit(&s->z) != Z_OK)
+		return false;
+	s->s.archive = &ar->ar;
+	s->s.no = no;
+	s->s.size = LittleEndian_getDW(hdr, 8);
+	s->e = e;
+	s->in_size = in_size;
+	s->in_pos = 16;
+	return true;
+}
+
+/*
+ * Inflate up to `len` bytes into `buf`, or discard them if `buf` is NULL.
+ */
+static bool aar_zstream_inflate(struct aar_zstream *s, uint8_t *buf, size_t len, size_t *nread)
+{
+	struct aar_archive *ar = (struct aar_archive*)s->s.archive;
+	uint8_t skip[4096];
+	size_t produced = 0;
+
+	while (produced < len) {
+		if (s->z.avail_in == 0) {
+			size_t chunk = min(sizeof(s->in), 16 + s->in_size - s->in_pos);
+			if (!chunk)
+				break;
+			if (!aar_read_raw(ar, s->e, s->in_pos, chunk, s->in))
+				return false;
+			s->z.next_in = s->in;
+			s->z.avail_in = chunk;
+			s->in_pos += chunk;
+		}
+		if (buf) {
+			s->z.next_out = buf + produced;
+			s->z.avail_out = len - produced;
+		} else {
+			s->z.next_out = skip;
+			s->z.avail_out = min(sizeof(skip), len - produced);
+		}
+		size_t avail = s->z.avail_out;
+		int r = inflate(&s->z, Z_NO_FLUSH);
+		produced += avail - s->z.avail_out;
+		if (r == Z_STREAM_END)
+			break;
+		if (r != Z_OK) {
+			WARNING("inflate failed");
+			return false;
+		}
+	}
+	s->out_pos += produced;
+	*nread = produced;
+	return true;
+}
+
+static bool aar_zstream_read(struct archive_stream *s, uint8_t *buf, size_t len, size_t *nread)
+{
+	return aar_zstream_inflate((struct aar_zstream*)s, buf, len, nread);
+}
+
+static bool aar_zstream_seek(struct archive_stream *_s, size_t pos)
+{
+	struct aar_zstream *s = (struct aar_zstream*)_s;
+	if (pos < s->out_pos) {
+		if (inflateReset(&s->z) != Z_OK)
+			return false;
+		s->z.avail_in = 0;
+		s->in_pos = 16;
+		s->out_pos = 0;
+	}
+	while (s->out_pos < pos) {
+		size_t n;
+		if (!aar_zstream_inflate(s, NULL, pos - s->out_pos, &n) || !n)
+			return false;
+	}
+	return true;
+}
+
+static void aar_zstream_close(struct archive_stream *_s)
+{
+	struct aar_zstream *s = (struct aar_zstream*)_s;
+	inflateEnd(&s->z);
+	free(s);
+}
+
+static struct archive_stream_ops aar_zstream_ops = {
+	.read = aar_zstream_read,
+	.seek = aar_zstream_seek,
+	.close = aar_zstream_close,
+};
+
+static bool aar_read_range(struct archive *_ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread)
+{
+	struct aar_archive *ar = (struct aar_archive*)_ar;
+	struct aar_entry *e;
+	if ((uint32_t)no >= ar->nr_files || !(e = aar_resolve_symlink(ar, no)))
+		return false;
+
+	if (e->type == AAR_COMPRESSED) {
+		size_t size, n;
+		int key = e - ar->files;
+		uint8_t *cached = ar->ar.cache ? _archive_cache_get(&ar->ar, key, &size) : NULL;
+		if (cached) {
+			n = off < size ? min(len, size - off) : 0;
+			memcpy(buf, cached + off, n);
+			_archive_cache_release(&ar->ar, key, cached);
+			*nread = n;
+			return true;
+		}
+
+		// inflate only as far as the end of the range
+		struct aar_zstream s;
+		if (!aar_zstream_init(&s, ar, no, e))
+			return false;
+		bool ok = aar_zstream_seek(&s.s, min(off, s.s.size));
+		n = 0;
+		if (ok && off < s.s.size)
+			ok = aar_zstream_inflate(&s, buf, min(len, s.s.size - off), &n);
+		inflateEnd(&s.z);
+		*nread = n;
+		return ok;
+	}
+
+	size_t n = off < e->size ? min(len, e->size - off) : 0;
+	if (!aar_read_raw(ar, e, off, n, buf))
+		return false;
+	*nread = n;
+	return true;
+}
+
 static struct archive_data *aar_get_descriptor(struct archive *_ar, int no)
 {
 	struct aar_archive *ar = (struct aar_archive*)_ar;
 	if ((uint32_t)no >= ar->nr_files)
 		return NULL;
 	struct aar_entry *e = &ar->files[no];
-	struct archive_data *data = xcalloc(1, sizeof(struct archive_data));
-	data->size = e->size;  // Note: this may be compressed size
-	data->name = e->name;
-	data->no = no;
-	data->archive = _ar;
-	return data;
+	struct aar_data *data = xcalloc(1, sizeof(struct aar_data));
+	data->super.size = e->size;  // Note: this may be compressed size
+	data->super.name = e->name;
+	data->super.no = no;
+	data->super.archive = _ar;
+	return &data->super;
+}
+
+static struct archive_stream *aar_open_stream(struct archive *_ar, int no)
+{
+	struct aar_archive *ar = (struct aar_archive*)_ar;
+	struct aar_entry *e;
+	if ((uint32_t)no >= ar->nr_files || !(e = aar_resolve_symlink(ar, no)))
+		return NULL;
+
+	if (e->type != AAR_COMPRESSED) {
+		return _archive_open_file_stream(_ar, no, ar->f, ar->ar.mmapped ? ar->mmap_ptr : NULL,
+				e->off, e->size);
+	}
+
+	// serve the stream from the decompressed-entry cache if possible
+	struct archive_data *data = aar_get_descriptor(_ar, no);
+	if (aar_cache_get(data, e))
+		return _archive_open_data_stream(data);
+	aar_free_data(data);
+
+	struct aar_zstream *s = xmalloc(sizeof(struct aar_zstream));
+	if (!aar_zstream_init(s, ar, no, e)) {
+		free(s);
+		return NULL;
+	}
+	s->s.ops = &aar_zstream_ops;
+	return &s->s;
 }
 
 static struct archive_data *aar_get(struct archive *_ar, int no)
@@ -185,12 +449,29 @@ static void aar_release_file(struct archive_data *data)
 	if (!data->data)
 		return;
 	struct aar_archive *ar = (struct aar_archive*)data->archive;
+	struct aar_data *aardata = (struct aar_data*)data;
+	if (aardata->cached) {
+		_archive_cache_release(data->archive, aardata->cache_key, data->data);
+		aardata->cached = false;
+		data->data = NULL;
+		return;
+	}
 	uint8_t *mmap_ptr = ar->mmap_ptr;
 	if (!(mmap_ptr && mmap_ptr <= data->data && data->data < mmap_ptr + ar->file_size))
 		free(data->data);
 	data->data = NULL;
 }
 
+static struct archive_data *aar_copy_descriptor(struct archive_data *src)
+{
+	// name points inside aar_archive.index_buf, so it isn't duplicated
+	struct aar_data *dst = xmalloc(sizeof(struct aar_data));
+	*dst = *(struct aar_data*)src;
+	dst->super.data = NULL;
+	dst->cached = false;
+	return &dst->super;
+}
+
 static void aar_for_each(struct archive *_ar, void (*iter)(struct archive_data *data, void *user), void *user)
 {
 	struct aar_archive *ar = (struct aar_archive*)_ar;
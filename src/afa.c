@@ -40,6 +40,8 @@ static struct archive_data *afa_get(struct archive *ar, int no);
 static struct archive_data *afa_get_by_name(struct archive *ar, const char *name);
 static struct archive_data *afa_get_by_basename(struct archive *ar, const char *name);
 static bool afa_load_file(struct archive_data *data);
+static bool afa_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+static struct archive_stream *afa_open_stream(struct archive *ar, int no);
 static void afa_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void afa_free_data(struct archive_data *data);
 static void afa_free(struct archive *ar);
@@ -53,36 +55,48 @@ struct archive_ops afa_archive_ops = {
 	.get_by_basename = afa_get_by_basename,
 	.load_file = afa_load_file,
 	.release_file = NULL,
+	.read_range = afa_read_range,
+	.open_stream = afa_open_stream,
 	.copy_descriptor = NULL,
 	.for_each = afa_for_each,
 	.free_data = afa_free_data,
 	.free = afa_free,
 };
 
-static struct afa_entry *afa_get_entry_by_name(struct afa_archive *ar, const char *name)
+static struct hash_table *afa_build_name_index(struct archive *_ar)
 {
-	if (!ar->name_index) {
-		ar->name_index = ht_create(ar->nr_files * 3 / 2);
-		for (unsigned i = 0; i < ar->nr_files; i++) {
-			ht_put(ar->name_index, ar->files[i].name->text, &ar->files[i]);
-		}
+	struct afa_archive *ar = (struct afa_archive*)_ar;
+	struct hash_table *index = ht_create(ar->nr_files * 3 / 2);
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		ht_put(index, ar->files[i].name->text, &ar->files[i]);
 	}
-	return ht_get(ar->name_index, name, NULL);
+	return index;
 }
 
-static struct afa_entry *afa_get_entry_by_basename(struct afa_archive *ar, const char *name)
+static struct hash_table *afa_build_basename_index(struct archive *_ar)
 {
-	if (!ar->basename_index) {
-		ar->basename_index = ht_create(ar->nr_files * 3 / 2);
-		for (unsigned i = 0; i < ar->nr_files; i++) {
-			char *basename = archive_basename(ar->files[i].name->text);
-			ht_put(ar->basename_index, basename, &ar->files[i]);
-			free(basename);
-		}
+	struct afa_archive *ar = (struct afa_archive*)_ar;
+	struct hash_table *index = ht_create(ar->nr_files * 3 / 2);
+	for (unsigned i = 0; i < ar->nr_files; i++) {
+		char *basename = archive_basename(ar->files[i].name->text);
+		ht_put(index, basename, &ar->files[i]);
+		free(basename);
 	}
+	return index;
+}
+
+static struct afa_entry *afa_get_entry_by_name(struct afa_archive *ar, const char *name)
+{
+	struct hash_table *index = _archive_lazy_index(&ar->ar, &ar->name_index, afa_build_name_index);
+	return ht_get(index, name, NULL);
+}
 
+static struct afa_entry *afa_get_entry_by_basename(struct afa_archive *ar, const char *name)
+{
+	struct hash_table *index = _archive_lazy_index(&ar->ar, &ar->basename_index,
+			afa_build_basename_index);
 	char *basename = archive_basename(name);
-	struct afa_entry *entry = ht_get(ar->basename_index, basename, NULL);
+	struct afa_entry *entry = ht_get(index, basename, NULL);
 	free(basename);
 	return entry;
 }
@@ -92,13 +106,6 @@ static struct afa_entry *afa_get_entry_by_number(struct afa_archive *ar, int no)
 	if (!ar->has_number) {
 		return ((uint32_t)no < ar->nr_files) ? &ar->files[no] : NULL;
 	}
-
-	if (!ar->number_index) {
-		ar->number_index = ht_create(ar->nr_files * 3 / 2);
-		for (unsigned i = 0; i < ar->nr_files; i++) {
-			ht_put_int(ar->number_index, ar->files[i].no, &ar->files[i]);
-		}
-	}
 	return ht_get_int(ar->number_index, no, NULL);
 }
 
@@ -143,19 +150,46 @@ static bool afa_load_file(struct archive_data *data)
 		return true;
 	}
 
-	fseek(ar->f, ar->data_start + e->off, SEEK_SET);
-
 	data->data = xmalloc(e->size);
-	if (fread(data->data, e->size, 1, ar->f) != 1) {
+	if (!file_pread(ar->f, data->data, e->size, ar->data_start + e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(data->data);
-		free(data);
+		data->data = NULL;
 		return false;
 	}
 
 	return true;
 }
 
+static bool afa_read_range(struct archive *_ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread)
+{
+	struct afa_archive *ar = (struct afa_archive*)_ar;
+	struct afa_entry *e = afa_get_entry_by_number(ar, no);
+	if (!e)
+		return false;
+
+	size_t n = off < e->size ? min(len, e->size - off) : 0;
+	size_t pos = ar->data_start + e->off + off;
+	if (ar->ar.mmapped) {
+		memcpy(buf, (uint8_t*)ar->mmap_ptr + pos, n);
+	} else if (n && !file_pread(ar->f, buf, n, pos)) {
+		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
+		return false;
+	}
+	*nread = n;
+	return true;
+}
+
+static struct archive_stream *afa_open_stream(struct archive *_ar, int no)
+{
+	struct afa_archive *ar = (struct afa_archive*)_ar;
+	struct afa_entry *e = afa_get_entry_by_number(ar, no);
+	if (!e)
+		return NULL;
+	return _archive_open_file_stream(_ar, no, ar->f, ar->ar.mmapped ? ar->mmap_ptr : NULL,
+			ar->data_start + e->off, e->size);
+}
+
 struct archive_data *afa_entry_to_descriptor(struct afa_archive *ar, struct afa_entry *e)
 {
 	struct archive_data *data = xcalloc(1, sizeof(struct archive_data));
@@ -307,6 +341,14 @@ static bool afa_read_file_table(FILE *f, struct afa_archive *ar, int *error, str
 		}
 	}
 
+	// Built eagerly so that lookups by number never modify the archive.
+	if (ar->has_number) {
+		ar->number_index = ht_create(ar->nr_files * 3 / 2);
+		for (unsigned i = 0; i < ar->nr_files; i++) {
+			ht_put_int(ar->number_index, ar->files[i].no, &ar->files[i]);
+		}
+	}
+
 	free(buf);
 	free(table);
 	return true;
@@ -316,9 +358,11 @@ exit_err:
 	return false;
 }
 
-bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv);
+bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv,
+			const char *path);
 
-static bool afa_read_metadata(FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv)
+static bool afa_read_metadata(FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv,
+			      const char *path)
 {
 	char buf[44];
 	if (fread(buf, 44, 1, f) != 1) {
@@ -337,7 +381,7 @@ static bool afa_read_metadata(FILE *f, struct afa_archive *ar, int *error, strin
 
 	if (strncmp(buf+8, "AlicArch", 8)) {
 		if (LittleEndian_getDW((uint8_t*)buf, 8) == 3) {
-			return afa3_read_metadata(buf, f, ar, error, conv);
+			return afa3_read_metadata(buf, f, ar, error, conv, path);
 		}
 		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
 		return false;
@@ -396,7 +440,7 @@ struct afa_archive *afa_open_conv(const char *file, int flags, int *error,
 		*error = ARCHIVE_FILE_ERROR;
 		goto exit_err;
 	}
-	if (!afa_read_metadata(fp, ar, error, conv)) {
+	if (!afa_read_metadata(fp, ar, error, conv, (flags & ARCHIVE_CACHE_INDEX) ? file : NULL)) {
 		WARNING("afa_read_metadata failed");
 		fclose(fp);
 		goto exit_err;
@@ -50,6 +50,7 @@
 #include "system4/afa.h"
 #include "system4/archive.h"
 #include "system4/buffer.h"
+#include "system4/file.h"
 #include "system4/string.h"
 
 typedef struct string *(*string_conv_fun)(const char*,size_t);
@@ -115,80 +116,69 @@ static uint32_t rnd_get_next(void)
 }
 
 /*
- * Stream abstraction for reading non-byte-aligned data.
- * Can be backed by either a FILE* or a memory resident buffer.
+ * Stream abstraction for reading non-byte-aligned data from a memory
+ * resident buffer. Bits are consumed from a 64-bit cache which is refilled
+ * several bytes at a time.
  */
 struct bitstream {
-	enum {
-		BITSTREAM_FILE,
-		BITSTREAM_BUFFER
-	} type;
-	union {
-		FILE *f;
-		struct buffer b;
-	};
+	const uint8_t *data;
+	size_t size;
+	size_t pos;
 	int nr_cached;
-	uint32_t cache;
+	uint64_t cache;
 };
 
-/*
- * Initialize a bitstream from a FILE*.
- */
-static void bs_init_file(struct bitstream *bs, FILE *f, long off)
-{
-	bs->type = BITSTREAM_FILE;
-	bs->f = f;
-	fseek(f, off, SEEK_SET);
-	bs->nr_cached = 0;
-	bs->cache = 0;
-}
-
 /*
  * Initialize a bitsream from a buffer.
  */
-static void bs_init_buffer(struct bitstream *bs, uint8_t *buf, size_t size)
+static void bs_init_buffer(struct bitstream *bs, const uint8_t *buf, size_t size)
 {
-	bs->type = BITSTREAM_BUFFER;
-	buffer_init(&bs->b, buf, size);
+	bs->data = buf;
+	bs->size = size;
+	bs->pos = 0;
 	bs->nr_cached = 0;
 	bs->cache = 0;
 }
 
 /*
- * Read the next byte from a bitstream (internal).
+ * Load as many whole bytes as will fit into the cache (internal).
  */
-static int _bs_next_byte(struct bitstream *bs)
+static void _bs_refill(struct bitstream *bs)
 {
-	if (bs->type == BITSTREAM_FILE) {
-		uint8_t b;
-		if (fread(&b, 1, 1, bs->f) != 1) {
-			return -1;
-		}
-		return b;
+	if (bs->pos + 8 <= bs->size) {
+		const uint8_t *p = bs->data + bs->pos;
+		uint64_t word = (uint64_t)p[0] << 56 | (uint64_t)p[1] << 48
+			| (uint64_t)p[2] << 40 | (uint64_t)p[3] << 32
+			| (uint64_t)p[4] << 24 | (uint64_t)p[5] << 16
+			| (uint64_t)p[6] << 8 | (uint64_t)p[7];
+		int nr_bytes = (64 - bs->nr_cached) >> 3;
+		if (nr_bytes == 8)
+			bs->cache = word;
+		else
+			bs->cache = (bs->cache << (nr_bytes * 8)) | (word >> (64 - nr_bytes * 8));
+		bs->pos += nr_bytes;
+		bs->nr_cached += nr_bytes * 8;
+		return;
 	}
-	if (buffer_remaining(&bs->b) < 1) {
-		return -1;
+	while (bs->nr_cached <= 56 && bs->pos < bs->size) {
+		bs->cache = (bs->cache << 8) | bs->data[bs->pos++];
+		bs->nr_cached += 8;
 	}
-	return buffer_read_u8(&bs->b);
 }
 
 /*
- * Read an arbitrary number of bits from a bitstream (MSB order).
+ * Read an arbitrary number of bits (up to 32) from a bitstream (MSB order).
  */
 static int bs_read_bits(struct bitstream *bs, int count)
 {
-	while (bs->nr_cached < count) {
-		int b = _bs_next_byte(bs);
-		if (b < 0) {
+	if (bs->nr_cached < count) {
+		_bs_refill(bs);
+		if (bs->nr_cached < count)
 			return -1;
-		}
-		bs->cache = (bs->cache << 8) | (uint8_t)b;
-		bs->nr_cached += 8;
 	}
 
-	int mask = (1 << count) - 1;
 	bs->nr_cached -= count;
-	return (bs->cache >> bs->nr_cached) & mask;
+	return (bs->cache >> bs->nr_cached) & ((1ull << count) - 1);
 }
 
 /*
@@ -292,9 +282,11 @@ static char *afa3_decrypt_string(uint16_t *chars, size_t size)
 }
 
 /*
- * Read the metadata for a single file.
+ * Read the metadata for a single file. If `raw_name` is not NULL, it receives
+ * the decrypted (unconverted) file name.
  */
-static bool afa3_read_entry(struct bitstream *bs, struct afa_entry *entry, int *error, string_conv_fun conv)
+static bool afa3_read_entry(struct bitstream *bs, struct afa_entry *entry, int *error, string_conv_fun conv,
+			    char **raw_name)
 {
 	size_t size;
 	uint16_t *chars = NULL;
@@ -318,7 +310,10 @@ static bool afa3_read_entry(struct bitstream *bs, struct afa_entry *entry, int *
 	entry->off = bs_read_int32(bs);
 	entry->size = bs_read_int32(bs);
 	free(chars);
-	free(name);
+	if (raw_name)
+		*raw_name = name;
+	else
+		free(name);
 	return true;
 err:
 	free(chars);
@@ -327,16 +322,200 @@ err:
 }
 
 /*
- * Read the archive metadata.
+ * Sidecar index cache.
+ *
+ * Decoding the obfuscated index is slow for large archives, so the decoded
+ * file table can be stored next to the archive in "<archive>.idx". The cache
+ * is only used if the archive's size, mtime and header match those recorded
+ * when it was written. File names are stored before conversion so that the
+ * cache does not depend on the caller's `conv` function.
  */
-bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv)
+#define AFA3_CACHE_MAGIC "AFA3IDX"
+#define AFA3_CACHE_VERSION 1
+
+struct afa3_cache_key {
+	uint64_t file_size;
+	int64_t mtime;
+	uint8_t hdr[12];
+};
+
+static char *afa3_cache_path(const char *path)
+{
+	size_t len = strlen(path);
+	char *cache_path = xmalloc(len + 5);
+	memcpy(cache_path, path, len);
+	memcpy(cache_path + len, ".idx", 5);
+	return cache_path;
+}
+
+static bool afa3_cache_key_init(struct afa3_cache_key *key, const char *path, char *hdr)
 {
+	ustat s;
+	if (stat_utf8(path, &s) < 0)
+		return false;
+	key->file_size = s.st_size;
+	key->mtime = s.st_mtime;
+	memcpy(key->hdr, hdr, 12);
+	return true;
+}
+
+static bool cache_read_u32(struct buffer *r, uint32_t *out)
+{
+	if (buffer_remaining(r) < 4)
+		return false;
+	*out = buffer_read_int32(r);
+	return true;
+}
+
+static bool cache_read_u64(struct buffer *r, uint64_t *out)
+{
+	uint32_t lo, hi;
+	if (!cache_read_u32(r, &lo) || !cache_read_u32(r, &hi))
+		return false;
+	*out = ((uint64_t)hi << 32) | lo;
+	return true;
+}
+
+/*
+ * Read the file table from the index cache. Returns false (without modifying
+ * the archive) if the cache is missing, stale or corrupt.
+ */
+static bool afa3_read_index_cache(const char *path, struct afa3_cache_key *key,
+				  struct afa_archive *ar, string_conv_fun conv)
+{
+	char *cache_path = afa3_cache_path(path);
+	size_t size;
+	uint8_t *data = file_read(cache_path, &size);
+	free(cache_path);
+	if (!data)
+		return false;
+
+	struct buffer r;
+	buffer_init(&r, data, size);
+
+	uint32_t version, compressed_size, uncompressed_size, nr_files;
+	uint64_t file_size, mtime;
+	if (size < 8 + 12 || memcmp(data, AFA3_CACHE_MAGIC, 8))
+		goto err;
+	buffer_skip(&r, 8);
+	if (!cache_read_u32(&r, &version) || version != AFA3_CACHE_VERSION)
+		goto err;
+	if (!cache_read_u64(&r, &file_size) || file_size != key->file_size)
+		goto err;
+	if (!cache_read_u64(&r, &mtime) || (int64_t)mtime != key->mtime)
+		goto err;
+	if (buffer_remaining(&r) < 12 || memcmp(buffer_strdata(&r), key->hdr, 12))
+		goto err;
+	buffer_skip(&r, 12);
+	if (!cache_read_u32(&r, &compressed_size) || !cache_read_u32(&r, &uncompressed_size)
+	    || !cache_read_u32(&r, &nr_files))
+		goto err;
+	if (nr_files > buffer_remaining(&r) / 20)
+		goto err;
+
+	struct afa_entry *files = xcalloc(nr_files, sizeof(struct afa_entry));
+	uint32_t i;
+	for (i = 0; i < nr_files; i++) {
+		uint32_t name_len;
+		if (!cache_read_u32(&r, &name_len) || buffer_remaining(&r) < name_len)
+			break;
+		const char *name = buffer_strdata(&r);
+		buffer_skip(&r, name_len);
+		if (!cache_read_u32(&r, &files[i].unknown0) || !cache_read_u32(&r, &files[i].unknown1)
+		    || !cache_read_u32(&r, &files[i].off) || !cache_read_u32(&r, &files[i].size))
+			break;
+		files[i].name = conv(name, name_len);
+		files[i].no = i;
+	}
+	if (i < nr_files || buffer_remaining(&r)) {
+		for (uint32_t j = 0; j < nr_files; j++) {
+			if (files[j].name)
+				free_string(files[j].name);
+		}
+		free(files);
+		goto err;
+	}
+
+	ar->nr_files = nr_files;
+	ar->files = files;
+	ar->compressed_size = compressed_size;
+	ar->uncompressed_size = uncompressed_size;
+	free(data);
+	return true;
+err:
+	free(data);
+	return false;
+}
+
+/*
+ * Write the file table to the index cache. Failure is not an error; the
+ * index will simply be decoded again next time.
+ */
+static void afa3_write_index_cache(const char *path, struct afa3_cache_key *key,
+				   struct afa_archive *ar, char **raw_names)
+{
+	struct buffer out = {0};
+	buffer_write_bytes(&out, (const uint8_t*)AFA3_CACHE_MAGIC, 8);
+	buffer_write_int32(&out, AFA3_CACHE_VERSION);
+	buffer_write_int32(&out, key->file_size & 0xffffffff);
+	buffer_write_int32(&out, key->file_size >> 32);
+	buffer_write_int32(&out, (uint64_t)key->mtime & 0xffffffff);
+	buffer_write_int32(&out, (uint64_t)key->mtime >> 32);
+	buffer_write_bytes(&out, key->hdr, 12);
+	buffer_write_int32(&out, ar->compressed_size);
+	buffer_write_int32(&out, ar->uncompressed_size);
+	buffer_write_int32(&out, ar->nr_files);
+	for (uint32_t i = 0; i < ar->nr_files; i++) {
+		buffer_write_pascal_cstring(&out, raw_names[i]);
+		buffer_write_int32(&out, ar->files[i].unknown0);
+		buffer_write_int32(&out, ar->files[i].unknown1);
+		buffer_write_int32(&out, ar->files[i].off);
+		buffer_write_int32(&out, ar->files[i].size);
+	}
+
+	char *cache_path = afa3_cache_path(path);
+	if (!file_write(cache_path, out.buf, out.index))
+		remove_utf8(cache_path);
+	free(cache_path);
+	free(out.buf);
+}
+
+/*
+ * Read the archive metadata. If `path` is not NULL, the decoded file table is
+ * read from (or written to) the index cache for that archive.
+ */
+bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error, string_conv_fun conv,
+			const char *path)
+{
+	uint8_t *index = NULL;
 	uint8_t *packed = NULL;
 	uint8_t *unpacked = NULL;
+	char **raw_names = NULL;
 	uint32_t index_size = LittleEndian_getDW((uint8_t*)hdr, 4);
 
+	struct afa3_cache_key key;
+	if (path && !afa3_cache_key_init(&key, path, hdr))
+		path = NULL;
+	if (path && afa3_read_index_cache(path, &key, ar, conv)) {
+		ar->version = 3;
+		ar->data_start = index_size + 8;
+		return true;
+	}
+
+	// read the whole (obfuscated) index in one go
+	if (index_size < 4 || index_size + 8 > ar->file_size) {
+		*error = ARCHIVE_BAD_ARCHIVE_ERROR;
+		return false;
+	}
+	index = xmalloc(index_size - 4);
+	fseek(f, 12, SEEK_SET);
+	if (fread(index, index_size - 4, 1, f) != 1) {
+		*error = ARCHIVE_FILE_ERROR;
+		goto err;
+	}
+
 	struct bitstream bs;
-	bs_init_file(&bs, f, 12);
+	bs_init_buffer(&bs, index, index_size - 4);
 	bs_read_bits(&bs, 1); // skip first bit (obfuscation)
 	read_dict(&bs);
 	unsigned long packed_size = bs_read_int32(&bs);
@@ -359,10 +538,15 @@ bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error,
 	bs_read_bits(&bs, 1); // skip first bit (obfuscation)
 	ar->nr_files = bs_read_int32(&bs);
 	ar->files = xcalloc(ar->nr_files, sizeof(struct afa_entry));
+	if (path)
+		raw_names = xcalloc(ar->nr_files, sizeof(char*));
 	for (unsigned i = 0; i < ar->nr_files; i++) {
-		if (bs_read_bits(&bs, 2) == -1)
+		if (bs_read_bits(&bs, 2) == -1) {
+			// truncated index; don't cache it
+			path = NULL;
 			break;
-		if (!afa3_read_entry(&bs, &ar->files[i], error, conv)) {
+		}
+		if (!afa3_read_entry(&bs, &ar->files[i], error, conv, raw_names ? &raw_names[i] : NULL)) {
 			free(ar->files);
 			goto err;
 		}
@@ -374,10 +558,27 @@ bool afa3_read_metadata(char *hdr, FILE *f, struct afa_archive *ar, int *error,
 	ar->compressed_size = packed_size;
 	ar->uncompressed_size = unpacked_size;
 
+	if (path)
+		afa3_write_index_cache(path, &key, ar, raw_names);
+
+	if (raw_names) {
+		for (unsigned i = 0; i < ar->nr_files; i++) {
+			free(raw_names[i]);
+		}
+		free(raw_names);
+	}
+	free(index);
 	free(packed);
 	free(unpacked);
 	return true;
 err:
+	if (raw_names) {
+		for (unsigned i = 0; i < ar->nr_files; i++) {
+			free(raw_names[i]);
+		}
+		free(raw_names);
+	}
+	free(index);
 	free(packed);
 	free(unpacked);
 	return false;
@@ -15,16 +15,24 @@
  */
 
 #include <stdbool.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <turbojpeg.h>
+#include <jpeglib.h>
+#include <jerror.h>
 #include <webp/decode.h>
 #include <zlib.h>
 #include "little_endian.h"
 #include "system4.h"
+#include "system4/ajp.h"
 #include "system4/cg.h"
+#include "system4/jpeg.h"
 #include "system4/pms.h"
 #include "system4/webp.h"
+#include "cg_decoder.h"
+#include "pixel_conv.h"
 
 bool ajp_checkfmt(const uint8_t *data)
 {
@@ -77,69 +85,338 @@ static void ajp_init_metrics(struct ajp_header *ajp, struct cg_metrics *dst)
 	dst->alpha_pitch = 1;
 }
 
-static uint8_t *read_mask(uint8_t *pixels, uint8_t *mask_data, struct ajp_header *ajp)
+// bytes of a zlib mask inflated at a time
+#define AJP_MASK_CHUNK_SIZE (16 * 1024)
+// bytes of PMS header read by pms8_checkfmt and pms_get_metrics
+#define AJP_PMS_HEADER_SIZE 44
+
+/*
+ * The mask is written to `n` alpha values `pitch` bytes apart: either the
+ * alpha channel of an RGBA image, or a plain alpha plane. The mask values are
+ * also added to `stats`, if it isn't NULL.
+ */
+static void merge_alpha(uint8_t *alpha, size_t pitch, const uint8_t *mask, size_t n, size_t mask_pitch,
+		struct pixel_alpha_stats *stats)
 {
-	if (ajp->mask_size && pms8_checkfmt(mask_data)) {
-		return pms_extract_mask(mask_data, ajp->mask_size);
-	} else if (ajp->mask_size && webp_checkfmt(mask_data)) {
-		int w, h;
-		uint8_t *tmp = WebPDecodeRGBA(mask_data, ajp->mask_size, &w, &h);
-		if (w != ajp->width || h != ajp->height) {
-			WARNING("Unexpected AJP mask size");
-			WebPFree(tmp);
-			return NULL;
+	if (pitch == 4 && mask_pitch == 1) {
+		// the alpha channel of RGBA pixels
+		pixel_set_alpha(alpha - 3, mask, n);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			alpha[i*pitch] = mask[i*mask_pitch];
 		}
-		// discard pixel data
-		uint8_t *mask = xmalloc(ajp->width * ajp->height);
-		for (int i = 0; i < ajp->width * ajp->height; i++) {
-			mask[i] = tmp[i*4+3];
+	}
+	if (stats)
+		pixel_alpha_stats_add(stats, mask, mask_pitch, n);
+}
+
+static void fill_alpha(uint8_t *alpha, size_t pitch, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		alpha[i*pitch] = 0xFF;
+	}
+}
+
+/*
+ * Inflate a zlib mask into the alpha channel. Only the (decrypted) head of the
+ * stream is copied; the rest is read in place.
+ */
+static bool inflate_mask(uint8_t *alpha, size_t pitch, size_t n, const uint8_t *head, size_t head_size,
+		const uint8_t *rest, size_t rest_size, struct pixel_alpha_stats *stats)
+{
+	struct cg_decoder_ctx *ctx = cg_decoder_ctx_get();
+	z_stream *z = cg_decoder_inflate(ctx, 0, head, head_size);
+	if (!z)
+		return false;
+
+	uint8_t *chunk = cg_decoder_scratch(ctx, AJP_MASK_CHUNK_SIZE);
+	size_t done = 0;
+	for (;;) {
+		if (!z->avail_in && rest_size) {
+			z->next_in = (Bytef*)rest;
+			z->avail_in = rest_size;
+			rest_size = 0;
 		}
-		WebPFree(tmp);
-		return mask;
-	} else if (mask_data[0] == 0x78) {
-		// compressed
-		unsigned long uncompressed_size = ajp->width * ajp->height;
-		uint8_t *mask = xmalloc(uncompressed_size);
-		if (uncompress(mask, &uncompressed_size, mask_data, ajp->mask_size) != Z_OK) {
+		z->next_out = chunk;
+		z->avail_out = AJP_MASK_CHUNK_SIZE;
+		int rv = inflate(z, Z_NO_FLUSH);
+		size_t got = z->next_out - chunk;
+		if (got > n - done) {
+			WARNING("AJP mask too large");
+			return false;
+		}
+		merge_alpha(alpha + done*pitch, pitch, chunk, got, 1, stats);
+		done += got;
+		if (rv == Z_STREAM_END)
+			break;
+		if (rv != Z_OK) {
 			WARNING("uncompress failed");
-			free(mask);
-			return NULL;
-		} else if (uncompressed_size != (unsigned)ajp->width * (unsigned)ajp->height) {
-			WARNING("Unexpected AJP mask size");
+			return false;
 		}
-		return mask;
 	}
-	if (ajp->mask_size)
+	if (done != n)
+		WARNING("Unexpected AJP mask size");
+	return true;
+}
+
+static bool read_mask(uint8_t *alpha, size_t pitch, const uint8_t *mask_data, struct ajp_header *ajp,
+		struct pixel_alpha_stats *stats)
+{
+	size_t n = (size_t)ajp->width * ajp->height;
+	uint8_t head[16] = {0};
+	size_t head_size = min(ajp->mask_size, (uint32_t)sizeof(head));
+	memcpy(head, mask_data, head_size);
+	ajp_decrypt(head, head_size);
+
+	if (head[0] == 0x78) {
+		// compressed
+		return inflate_mask(alpha, pitch, n, head, head_size, mask_data + head_size,
+				ajp->mask_size - head_size, stats);
+	}
+
+	// the head is too short to check a PMS header; that waits for the whole mask
+	bool pms = head[0] == 'P' && head[1] == 'M';
+	if (!pms && !webp_checkfmt(head)) {
 		WARNING("Unsupported AJP mask format: %02x %02x %02x %02x",
-				mask_data[0], mask_data[1], mask_data[2], mask_data[3]);
+				head[0], head[1], head[2], head[3]);
+		return false;
+	}
+
+	// PMS and WebP masks need the whole (decrypted) mask in memory
+	uint8_t *mask = xmalloc(ajp->mask_size);
+	memcpy(mask, head, head_size);
+	memcpy(mask + head_size, mask_data + head_size, ajp->mask_size - head_size);
 
-	return NULL;
+	if (pms) {
+		struct cg_metrics m;
+		uint8_t *pms_alpha = NULL;
+		if (ajp->mask_size < AJP_PMS_HEADER_SIZE || !pms8_checkfmt(mask)) {
+			WARNING("Unsupported AJP mask format: not an 8-bit PMS");
+		} else {
+			pms_get_metrics(mask, &m);
+			if (m.w != ajp->width || m.h != ajp->height)
+				WARNING("Unexpected AJP mask size");
+			else
+				pms_alpha = pms_extract_mask(mask, ajp->mask_size);
+		}
+		free(mask);
+		if (!pms_alpha)
+			return false;
+		merge_alpha(alpha, pitch, pms_alpha, n, 1, stats);
+		free(pms_alpha);
+		return true;
+	}
+
+	int w, h;
+	uint8_t *tmp = WebPDecodeRGBA(mask, ajp->mask_size, &w, &h);
+	free(mask);
+	if (!tmp) {
+		WARNING("WebPDecodeRGBA failed");
+		return false;
+	}
+	if (w != ajp->width || h != ajp->height) {
+		WARNING("Unexpected AJP mask size");
+		WebPFree(tmp);
+		return false;
+	}
+	merge_alpha(alpha, pitch, tmp + 3, n, 4, stats);
+	WebPFree(tmp);
+	return true;
 }
 
-static uint8_t *load_mask(uint8_t *pixels, uint8_t *mask_data, struct ajp_header *ajp)
+/*
+ * Merge the mask into the alpha channel of the decoded image. If the mask
+ * can't be read, the image is left opaque. Returns false if the image is
+ * opaque this way.
+ */
+static bool load_mask(uint8_t *rgba, const uint8_t *mask_data, struct ajp_header *ajp,
+		struct pixel_alpha_stats *stats)
 {
-	uint8_t *mask = read_mask(pixels, mask_data, ajp);
-	if (!mask) {
-		mask = xmalloc(ajp->width * ajp->height);
-		memset(mask, 0xFF, ajp->width * ajp->height);
+	if (!ajp->mask_size)
+		return false;
+	if (!read_mask(rgba + 3, 4, mask_data, ajp, stats)) {
+		fill_alpha(rgba + 3, 4, (size_t)ajp->width * ajp->height);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Like load_mask, for an image decoded at a reduced size of w*h: the mask is
+ * read at full size and averaged down.
+ */
+static bool load_scaled_mask(uint8_t *rgba, int w, int h, const uint8_t *mask_data,
+		struct ajp_header *ajp)
+{
+	if (!ajp->mask_size)
+		return false;
+
+	int mw = ajp->width, mh = ajp->height;
+	uint8_t *mask = xmalloc((size_t)mw * mh);
+	memset(mask, 0xFF, (size_t)mw * mh);
+	if (!read_mask(mask, 1, mask_data, ajp, NULL)) {
+		free(mask);
+		return false;
 	}
 
-	uint8_t *out = xmalloc(ajp->width * ajp->height * 4);
-	for (int i = 0; i < ajp->width * ajp->height; i++) {
-		out[i*4+0] = pixels[i*3+0];
-		out[i*4+1] = pixels[i*3+1];
-		out[i*4+2] = pixels[i*3+2];
-		out[i*4+3] = mask[i];
+	for (int y = 0; y < h; y++) {
+		int y0 = (int64_t)y * mh / h, y1 = (int64_t)(y + 1) * mh / h;
+		for (int x = 0; x < w; x++) {
+			int x0 = (int64_t)x * mw / w, x1 = (int64_t)(x + 1) * mw / w;
+			uint32_t sum = 0;
+			for (int sy = y0; sy < y1; sy++) {
+				for (int sx = x0; sx < x1; sx++) {
+					sum += mask[(size_t)sy * mw + sx];
+				}
+			}
+			uint32_t n = (x1 - x0) * (y1 - y0);
+			rgba[((size_t)y * w + x) * 4 + 3] = (sum + n / 2) / n;
+		}
 	}
-	free(pixels);
 	free(mask);
-	return out;
+	return true;
 }
 
-void ajp_extract(const uint8_t *data, size_t size, struct cg *cg)
+/*
+ * A libjpeg source for the JPEG part of an AJP. Only its first 16 bytes are
+ * encrypted, so those are served from a decrypted copy and the rest is read
+ * in place, without copying the JPEG.
+ */
+struct ajp_source {
+	struct jpeg_source_mgr pub;
+	uint8_t head[16];
+	const uint8_t *rest;
+	size_t rest_size;
+};
+
+static void ajp_source_noop(possibly_unused j_decompress_ptr cinfo) {}
+
+static boolean ajp_source_fill(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+	struct ajp_source *src = (struct ajp_source*)cinfo->src;
+	if (src->rest && src->rest_size) {
+		src->pub.next_input_byte = src->rest;
+		src->pub.bytes_in_buffer = src->rest_size;
+		src->rest = NULL;
+		return TRUE;
+	}
+	// truncated: insert an EOI marker, like libjpeg's own memory source
+	WARNMS(cinfo, JWRN_JPEG_EOF);
+	src->rest = NULL;
+	src->pub.next_input_byte = eoi;
+	src->pub.bytes_in_buffer = 2;
+	return TRUE;
+}
+
+static void ajp_source_skip(j_decompress_ptr cinfo, long n)
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+	if (n <= 0)
+		return;
+	while ((size_t)n > src->bytes_in_buffer) {
+		n -= src->bytes_in_buffer;
+		ajp_source_fill(cinfo);
+	}
+	src->next_input_byte += n;
+	src->bytes_in_buffer -= n;
+}
+
+static void ajp_source_init(struct ajp_source *src, const uint8_t *jpeg, size_t size)
+{
+	size_t head_size = min(size, sizeof(src->head));
+	memcpy(src->head, jpeg, head_size);
+	ajp_decrypt(src->head, head_size);
+	src->rest = jpeg + head_size;
+	src->rest_size = size - head_size;
+	src->pub.next_input_byte = src->head;
+	src->pub.bytes_in_buffer = head_size;
+	src->pub.init_source = ajp_source_noop;
+	src->pub.fill_input_buffer = ajp_source_fill;
+	src->pub.skip_input_data = ajp_source_skip;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = ajp_source_noop;
+}
+
+struct ajp_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf env;
+};
+
+static void ajp_error_exit(j_common_ptr cinfo)
+{
+	char msg[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, msg);
+	WARNING("JPEG decompression failed: %s", msg);
+	longjmp(((struct ajp_error*)cinfo->err)->env, 1);
+}
+
+static void ajp_output_message(j_common_ptr cinfo)
+{
+	char msg[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, msg);
+	WARNING("JPEG: %s", msg);
+}
+
+/*
+ * Decode the JPEG part of an AJP to RGBA, at a reduced size if it doesn't fit
+ * in max_w*max_h (see jpeg_get_decode_size). The size of the JPEG is stored in
+ * `width` and `height`, and the decoded size in `w` and `h`.
+ */
+static uint8_t *ajp_decode_jpeg(const uint8_t *jpeg, size_t size, int max_w, int max_h,
+		int *width, int *height, int *w, int *h)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct ajp_error err;
+	struct ajp_source src;
+	uint8_t *volatile buf = NULL;
+
+	cinfo.err = jpeg_std_error(&err.pub);
+	err.pub.error_exit = ajp_error_exit;
+	err.pub.output_message = ajp_output_message;
+	if (setjmp(err.env)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(buf);
+		return NULL;
+	}
+	jpeg_create_decompress(&cinfo);
+	ajp_source_init(&src, jpeg, size);
+	cinfo.src = &src.pub;
+	jpeg_read_header(&cinfo, TRUE);
+	*width = cinfo.image_width;
+	*height = cinfo.image_height;
+
+	// same output as tjDecompress2 with TJPF_RGBA and TJFLAG_FASTDCT
+	cinfo.out_color_space = JCS_EXT_RGBA;
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_get_decode_size(*width, *height, max_w, max_h, w, h);
+	if (*w != *width || *h != *height) {
+		// the TurboJPEG scaling factors are all multiples of 1/8
+		cinfo.scale_denom = 8;
+		for (cinfo.scale_num = 1; cinfo.scale_num < 8; cinfo.scale_num++) {
+			jpeg_calc_output_dimensions(&cinfo);
+			if ((int)cinfo.output_width == *w && (int)cinfo.output_height == *h)
+				break;
+		}
+	}
+	jpeg_start_decompress(&cinfo);
+	*w = cinfo.output_width;
+	*h = cinfo.output_height;
+
+	size_t pitch = (size_t)*w * 4;
+	buf = xmalloc(pitch * *h);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = buf + cinfo.output_scanline * pitch;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return buf;
+}
+
+static void ajp_decode(const uint8_t *data, size_t size, struct cg *cg, int max_w, int max_h)
 {
-	uint8_t *buf = NULL, *jpeg_data = NULL, *mask_data = NULL;
-	int width, height, subsamp;
+	int width, height;
 	struct ajp_header ajp;
 	ajp_extract_header(data, &ajp);
 	ajp_init_metrics(&ajp, &cg->metrics);
@@ -161,34 +438,48 @@ void ajp_extract(const uint8_t *data, size_t size, struct cg *cg)
 		return;
 	}
 
-	jpeg_data = xmalloc(ajp.jpeg_size);
-	mask_data = xmalloc(ajp.mask_size);
-	memcpy(jpeg_data, data + ajp.jpeg_off, ajp.jpeg_size);
-	memcpy(mask_data, data + ajp.mask_off, ajp.mask_size);
-	ajp_decrypt(jpeg_data, ajp.jpeg_size);
-	ajp_decrypt(mask_data, ajp.mask_size);
-
-	tjhandle decompressor = tjInitDecompress();
-	tjDecompressHeader2(decompressor, jpeg_data, ajp.jpeg_size, &width, &height, &subsamp);
+	int w, h;
+	uint8_t *buf = ajp_decode_jpeg(data + ajp.jpeg_off, ajp.jpeg_size, max_w, max_h,
+			&width, &height, &w, &h);
+	if (!buf)
+		return;
+	bool size_ok = (uint32_t)width == ajp.width && (uint32_t)height == ajp.height;
 	if ((uint32_t)width != ajp.width)
 		WARNING("AJP width doesn't match JPEG width (%d vs. %u)", width, ajp.width);
 	if ((uint32_t)height != ajp.height)
 		WARNING("AJP height doesn't match JPEG height (%d vs. %u)", height, ajp.height);
 
-	buf = xmalloc(width * height * 3);
-	if (tjDecompress2(decompressor, jpeg_data, ajp.jpeg_size, buf, width, 0, height, TJPF_RGB, TJFLAG_FASTDCT) < 0) {
-		WARNING("JPEG decompression failed: %s", tjGetErrorStr());
-		free(buf);
-		goto cleanup;
-	}
-
-	buf = load_mask(buf, mask_data, &ajp);
+	// the pixels follow the JPEG; if it disagrees with the header, the mask
+	// can't be trusted to fit
+	struct pixel_alpha_stats stats, *s = cg_alpha_stats_begin(&stats, w);
+	bool masked = false;
+	if (size_ok && w == width && h == height)
+		masked = load_mask(buf, data + ajp.mask_off, &ajp, s);
+	else if (size_ok)
+		masked = load_scaled_mask(buf, w, h, data + ajp.mask_off, &ajp);
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	cg->metrics.pixel_pitch = w * 3;
 
 	cg->type = ALCG_AJP;
 	cg->pixels = buf;
+	// a scaled mask leaves `stats` empty, and is scanned on demand
+	if (masked)
+		cg_alpha_stats_end(cg, s);
+	else
+		cg_set_opaque(cg);
+}
 
-cleanup:
-	free(jpeg_data);
-	free(mask_data);
-	tjDestroy(decompressor);
+void ajp_extract(const uint8_t *data, size_t size, struct cg *cg)
+{
+	ajp_decode(data, size, cg, INT_MAX, INT_MAX);
+}
+
+/*
+ * Decode an AJP at a reduced size, using DCT scaling (see
+ * jpeg_get_decode_size). The result may be larger than max_w*max_h.
+ */
+void ajp_extract_scaled(const uint8_t *data, size_t size, struct cg *cg, int max_w, int max_h)
+{
+	ajp_decode(data, size, cg, max_w, max_h);
 }
@@ -19,6 +19,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,12 +28,19 @@
 #include "little_endian.h"
 #include "system4.h"
 #include "system4/ald.h"
+#include "system4/buffer.h"
 #include "system4/file.h"
+#include "system4/hashtable.h"
 
 static bool ald_exists(struct archive *ar, int no);
+static bool ald_exists_by_name(struct archive *ar, const char *name, int *id_out);
+static bool ald_exists_by_basename(struct archive *ar, const char *name, int *id_out);
 static struct archive_data *ald_get(struct archive *ar, int no);
 static struct archive_data *ald_get_by_name(struct archive *_ar, const char *name);
+static struct archive_data *ald_get_by_basename(struct archive *_ar, const char *name);
 static bool ald_load_file(struct archive_data *data);
+static bool ald_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+static struct archive_stream *ald_open_stream(struct archive *ar, int no);
 static struct archive_data *ald_copy_descriptor(struct archive_data *src);
 static void ald_for_each(struct archive *_ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void ald_free_data(struct archive_data *data);
@@ -40,11 +48,15 @@ static void ald_free(struct archive *ar);
 
 struct archive_ops ald_archive_ops = {
 	.exists = ald_exists,
+	.exists_by_name = ald_exists_by_name,
+	.exists_by_basename = ald_exists_by_basename,
 	.get = ald_get,
 	.get_by_name = ald_get_by_name,
-	.get_by_basename = NULL,
+	.get_by_basename = ald_get_by_basename,
 	.load_file = ald_load_file,
 	.release_file = NULL,
+	.read_range = ald_read_range,
+	.open_stream = ald_open_stream,
 	.copy_descriptor = ald_copy_descriptor,
 	.for_each = ald_for_each,
 	.free_data = ald_free_data,
@@ -223,6 +235,66 @@ static bool ald_exists(struct archive *ar, int no)
 	return ar && !!_ald_get((struct ald_archive*)ar, no, &disk, &dataptr);
 }
 
+/* Read the header of an entry. The returned name must be freed by the caller. */
+static bool ald_read_header(struct ald_archive *ar, int disk, int dataptr, int *hdr_size_out,
+			    size_t *size_out, char **name_out)
+{
+	if (ar->ar.mmapped) {
+		uint8_t *hdr  = ar->files[disk].data + dataptr;
+		*hdr_size_out = LittleEndian_getDW(hdr, 0);
+		*size_out = LittleEndian_getDW(hdr, 4);
+		*name_out = ar->conv((char*)hdr + 16);
+		return true;
+	}
+
+	uint8_t hdr[16];
+	FILE *fp = ar->files[disk].fp;
+
+	// read header size, file size
+	if (!file_pread(fp, hdr, 16, dataptr))
+		return false;
+	int hdr_size = LittleEndian_getDW(hdr, 0);
+	if (hdr_size <= 16)
+		return false;
+
+	// read name
+	char *name = xcalloc(hdr_size-16, 1);
+	if (!file_pread(fp, name, hdr_size-16, dataptr + 16)) {
+		free(name);
+		return false;
+	}
+
+	*hdr_size_out = hdr_size;
+	*size_out = LittleEndian_getDW(hdr, 4);
+	*name_out = name;
+	return true;
+}
+
+/* Read all entry headers into ar->entries in a single pass. */
+static void ald_read_entries(struct ald_archive *ar)
+{
+	struct buffer names = {0};
+	ar->entries = xcalloc(max(ar->maxfile, 1), sizeof(struct ald_entry));
+	for (int i = 0; i < ar->maxfile; i++) {
+		int disk, dataptr, hdr_size;
+		size_t size;
+		char *name;
+		if (!_ald_get(ar, i, &disk, &dataptr))
+			continue;
+		if (!ald_read_header(ar, disk, dataptr, &hdr_size, &size, &name))
+			continue;
+		struct ald_entry *e = &ar->entries[i];
+		e->dataptr = dataptr;
+		e->hdr_size = hdr_size;
+		e->size = size;
+		e->name_off = names.index;
+		e->disk = disk;
+		buffer_write_cstringz(&names, name);
+		free(name);
+	}
+	ar->names = (char*)names.buf;
+}
+
 /* Get a descriptor for a file in an ALD archive. */
 struct archive_data *ald_get_descriptor(struct archive *_ar, int no)
 {
@@ -230,34 +302,32 @@ struct archive_data *ald_get_descriptor(struct archive *_ar, int no)
 		return NULL;
 
 	struct ald_archive *ar = (struct ald_archive*)_ar;
+
+	if (ar->entries) {
+		if (no < 0 || no >= ar->maxfile || !ar->entries[no].dataptr)
+			return NULL;
+		struct ald_entry *e = &ar->entries[no];
+		struct ald_archive_data *dfile = xcalloc(1, sizeof(struct ald_archive_data));
+		dfile->disk = e->disk;
+		dfile->dataptr = e->dataptr;
+		dfile->hdr_size = e->hdr_size;
+		dfile->data.size = e->size;
+		dfile->data.name = ar->names + e->name_off;
+		dfile->data.no = no;
+		dfile->data.archive = &ar->ar;
+		return &dfile->data;
+	}
+
 	struct ald_archive_data *dfile = calloc(1, sizeof(struct ald_archive_data));
 
 	if (!_ald_get(ar, no, &dfile->disk, &dfile->dataptr)) {
 		free(dfile);
 		return NULL;
 	}
-
-	// read header
-	if (ar->ar.mmapped) {
-		uint8_t *hdr  = ar->files[dfile->disk].data + dfile->dataptr;
-		dfile->hdr_size = LittleEndian_getDW(hdr, 0);
-		dfile->data.size = LittleEndian_getDW(hdr, 4);
-		dfile->data.name = ar->conv((char*)hdr + 16);
-	} else {
-		uint8_t *hdr = xmalloc(16);
-		FILE *fp = ar->files[dfile->disk].fp;
-
-		// read header size, file size
-		fseek(fp, dfile->dataptr, SEEK_SET);
-		fread(hdr, 16, 1, fp);
-		dfile->hdr_size = LittleEndian_getDW(hdr, 0);
-		dfile->data.size = LittleEndian_getDW(hdr, 4);
-
-		// read name
-		dfile->data.name = xcalloc(dfile->hdr_size-16, 1);
-		fread(dfile->data.name, dfile->hdr_size-16, 1, fp);
-
-		free(hdr);
+	if (!ald_read_header(ar, dfile->disk, dfile->dataptr, &dfile->hdr_size,
+			     &dfile->data.size, &dfile->data.name)) {
+		free(dfile);
+		return NULL;
 	}
 
 	dfile->data.no = no;
@@ -283,20 +353,86 @@ struct archive_data *ald_get(struct archive *ar, int no)
 	return data;
 }
 
-static struct archive_data *ald_get_by_name(struct archive *_ar, const char *name)
+/*
+ * Build the name and basename indices. If a name occurs more than once, the
+ * lowest ID wins. The basename index is published along with the name index,
+ * which is the one passed to _archive_lazy_index.
+ */
+static struct hash_table *ald_build_name_index(struct archive *_ar)
 {
 	struct ald_archive *ar = (struct ald_archive*)_ar;
+	struct hash_table *name_index = ht_create(ar->maxfile * 3 / 2);
+	ar->basename_index = ht_create(ar->maxfile * 3 / 2);
 	for (int i = 0; i < ar->maxfile; i++) {
-		struct archive_data *data = ald_get_descriptor(_ar, i);
+		struct archive_data *data = ald_get_descriptor(&ar->ar, i);
 		if (!data)
 			continue;
-		if (!strcmp(data->name, name)) {
-			ald_load_file(data);
-			return data;
-		}
+		ht_put(name_index, data->name, (void*)(intptr_t)i);
+		char *basename = archive_basename(data->name);
+		ht_put(ar->basename_index, basename, (void*)(intptr_t)i);
+		free(basename);
 		ald_free_data(data);
 	}
-	return NULL;
+	return name_index;
+}
+
+static bool ald_lookup_name(struct ald_archive *ar, const char *name, int *id_out)
+{
+	struct hash_table *index = _archive_lazy_index(&ar->ar, &ar->name_index, ald_build_name_index);
+	void *id;
+	if (!_ht_get(index, name, &id))
+		return false;
+	*id_out = (intptr_t)id;
+	return true;
+}
+
+static bool ald_lookup_basename(struct ald_archive *ar, const char *name, int *id_out)
+{
+	_archive_lazy_index(&ar->ar, &ar->name_index, ald_build_name_index);
+	void *id;
+	char *basename = archive_basename(name);
+	bool found = _ht_get(ar->basename_index, basename, &id);
+	free(basename);
+	if (!found)
+		return false;
+	*id_out = (intptr_t)id;
+	return true;
+}
+
+static bool ald_exists_by_name(struct archive *ar, const char *name, int *id_out)
+{
+	int id;
+	if (!ald_lookup_name((struct ald_archive*)ar, name, &id))
+		return false;
+	if (id_out)
+		*id_out = id;
+	return true;
+}
+
+static bool ald_exists_by_basename(struct archive *ar, const char *name, int *id_out)
+{
+	int id;
+	if (!ald_lookup_basename((struct ald_archive*)ar, name, &id))
+		return false;
+	if (id_out)
+		*id_out = id;
+	return true;
+}
+
+static struct archive_data *ald_get_by_name(struct archive *ar, const char *name)
+{
+	int id;
+	if (!ald_lookup_name((struct ald_archive*)ar, name, &id))
+		return NULL;
+	return ald_get(ar, id);
+}
+
+static struct archive_data *ald_get_by_basename(struct archive *ar, const char *name)
+{
+	int id;
+	if (!ald_lookup_basename((struct ald_archive*)ar, name, &id))
+		return NULL;
+	return ald_get(ar, id);
 }
 
 static bool ald_load_file(struct archive_data *data)
@@ -308,18 +444,82 @@ static bool ald_load_file(struct archive_data *data)
 	} else {
 		FILE *fp = ar->files[dfile->disk].fp;
 		data->data = xmalloc(data->size);
+		if (!file_pread(fp, data->data, data->size, dfile->dataptr + dfile->hdr_size)) {
+			free(data->data);
+			data->data = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Locate the data of a file without reading it. */
+static bool ald_get_data_location(struct ald_archive *ar, int no, int *disk_out, size_t *off_out,
+				  size_t *size_out)
+{
+	int dataptr, hdr_size;
 
-		fseek(fp, dfile->dataptr + dfile->hdr_size, SEEK_SET);
-		fread(data->data, data->size, 1, fp);
+	if (ar->entries) {
+		if (no < 0 || no >= ar->maxfile || !ar->entries[no].dataptr)
+			return false;
+		struct ald_entry *e = &ar->entries[no];
+		*disk_out = e->disk;
+		dataptr = e->dataptr;
+		hdr_size = e->hdr_size;
+		*size_out = e->size;
+	} else {
+		char *name;
+		if (!_ald_get(ar, no, disk_out, &dataptr))
+			return false;
+		if (!ald_read_header(ar, *disk_out, dataptr, &hdr_size, size_out, &name))
+			return false;
+		free(name);
 	}
-	return data;
+	*off_out = dataptr + hdr_size;
+	return true;
+}
+
+static bool ald_read_range(struct archive *_ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread)
+{
+	struct ald_archive *ar = (struct ald_archive*)_ar;
+	int disk;
+	size_t data_off, size;
+	if (!ald_get_data_location(ar, no, &disk, &data_off, &size))
+		return false;
+
+	size_t n = off < size ? min(len, size - off) : 0;
+	if (ar->ar.mmapped) {
+		memcpy(buf, ar->files[disk].data + data_off + off, n);
+	} else if (n && !file_pread(ar->files[disk].fp, buf, n, data_off + off)) {
+		return false;
+	}
+	*nread = n;
+	return true;
+}
+
+static struct archive_stream *ald_open_stream(struct archive *_ar, int no)
+{
+	struct ald_archive *ar = (struct ald_archive*)_ar;
+	int disk;
+	size_t off, size;
+	if (!ald_get_data_location(ar, no, &disk, &off, &size))
+		return NULL;
+	return _archive_open_file_stream(_ar, no, ar->files[disk].fp,
+			ar->ar.mmapped ? ar->files[disk].data : NULL, off, size);
 }
 
 static struct archive_data *ald_copy_descriptor(struct archive_data *_src)
 {
+	struct ald_archive *ar = (struct ald_archive*)_src->archive;
 	struct ald_archive_data *src = (struct ald_archive_data*)_src;
 	struct ald_archive_data *dst = xmalloc(sizeof(struct ald_archive_data));
-	_archive_copy_descriptor_ip(&dst->data, &src->data);
+	if (ar->entries) {
+		// name is owned by the archive
+		dst->data = src->data;
+		dst->data.data = NULL;
+	} else {
+		_archive_copy_descriptor_ip(&dst->data, &src->data);
+	}
 	dst->disk = src->disk;
 	dst->dataptr = src->dataptr;
 	dst->hdr_size = src->hdr_size;
@@ -345,7 +545,8 @@ static void ald_free_data(struct archive_data *data)
 		return;
 	if (!data->archive->mmapped && data->data)
 		free(data->data);
-	free(data->name);
+	if (!((struct ald_archive*)data->archive)->entries)
+		free(data->name);
 	free(data);
 }
 
@@ -365,7 +566,16 @@ static void ald_free(struct archive *_ar)
 			fclose(ar->files[i].fp);
 		}
 		free(ar->files[i].name);
+		free(ar->fileptr[i]);
 	}
+	free(ar->map_disk);
+	free(ar->map_ptr);
+	if (ar->name_index)
+		ht_free(ar->name_index);
+	if (ar->basename_index)
+		ht_free(ar->basename_index);
+	free(ar->entries);
+	free(ar->names);
 
 	free(ar);
 }
@@ -437,6 +647,8 @@ struct archive *ald_open_conv(char **files, int count, int flags, int *error, ch
 	ar->ar.mmapped = flags & ARCHIVE_MMAP;
 	ar->nr_files = count;
 	ar->ar.ops = &ald_archive_ops;
+	if (!(flags & ARCHIVE_LAZY_INDEX))
+		ald_read_entries(ar);
 	return &ar->ar;
 exit_err:
 	free(ar);
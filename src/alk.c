@@ -30,6 +30,8 @@
 static bool alk_exists(struct archive *ar, int no);
 static struct archive_data *alk_get(struct archive *ar, int no);
 static bool alk_load_file(struct archive_data *data);
+static bool alk_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+static struct archive_stream *alk_open_stream(struct archive *ar, int no);
 static void alk_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void alk_free_data(struct archive_data *data);
 static void alk_free(struct archive *_ar);
@@ -41,6 +43,8 @@ struct archive_ops alk_archive_ops = {
 	.get_by_basename = NULL,
 	.load_file = alk_load_file,
 	.release_file = NULL,
+	.read_range = alk_read_range,
+	.open_stream = alk_open_stream,
 	.copy_descriptor = NULL,
 	.for_each = alk_for_each,
 	.free_data = alk_free_data,
@@ -68,10 +72,8 @@ static bool alk_load_file(struct archive_data *data)
 		return true;
 	}
 
-	fseek(ar->f, e->off, SEEK_SET);
-
 	data->data = xmalloc(e->size);
-	if (fread(data->data, e->size, 1, ar->f) != 1) {
+	if (!file_pread(ar->f, data->data, e->size, e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(data->data);
 		data->data = NULL;
@@ -81,6 +83,34 @@ static bool alk_load_file(struct archive_data *data)
 	return true;
 }
 
+static bool alk_read_range(struct archive *_ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread)
+{
+	struct alk_archive *ar = (struct alk_archive*)_ar;
+	if (no < 0 || no >= ar->nr_files || !ar->files[no].size)
+		return false;
+	struct alk_entry *e = &ar->files[no];
+
+	size_t n = off < e->size ? min(len, e->size - off) : 0;
+	if (ar->ar.mmapped) {
+		memcpy(buf, (uint8_t*)ar->mmap_ptr + e->off + off, n);
+	} else if (n && !file_pread(ar->f, buf, n, e->off + off)) {
+		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
+		return false;
+	}
+	*nread = n;
+	return true;
+}
+
+static struct archive_stream *alk_open_stream(struct archive *_ar, int no)
+{
+	struct alk_archive *ar = (struct alk_archive*)_ar;
+	if (no < 0 || no >= ar->nr_files || !ar->files[no].size)
+		return NULL;
+	struct alk_entry *e = &ar->files[no];
+	return _archive_open_file_stream(_ar, no, ar->f, ar->ar.mmapped ? ar->mmap_ptr : NULL,
+			e->off, e->size);
+}
+
 static struct archive_data *alk_get_descriptor(struct archive *_ar, int no)
 {
 	struct alk_archive *ar = (struct alk_archive*)_ar;
@@ -16,9 +16,15 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "system4.h"
 #include "system4/ald.h"
+#include "system4/file.h"
+#include "system4/hashtable.h"
 #include "system4/utfsjis.h"
+#include "kvec.h"
+#include "lru_cache.h"
 
 static const char *errtab[ARCHIVE_MAX_ERROR] = {
 	[ARCHIVE_SUCCESS]           = "Success",
@@ -41,6 +47,149 @@ void _archive_release_file(struct archive_data *data)
 	data->data = NULL;
 }
 
+bool archive_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread)
+{
+	if (ar->ops->read_range)
+		return ar->ops->read_range(ar, no, off, len, buf, nread);
+
+	struct archive_data *data = archive_get(ar, no);
+	if (!data)
+		return false;
+	size_t n = off < data->size ? min(len, data->size - off) : 0;
+	memcpy(buf, data->data + off, n);
+	archive_free_data(data);
+	*nread = n;
+	return true;
+}
+
+struct file_stream {
+	struct archive_stream s;
+	FILE *f;
+	const uint8_t *map;
+	size_t off;
+};
+
+static bool file_stream_read(struct archive_stream *_s, uint8_t *buf, size_t len, size_t *nread)
+{
+	struct file_stream *s = (struct file_stream*)_s;
+	if (s->map)
+		memcpy(buf, s->map + s->off + s->s.pos, len);
+	else if (!file_pread(s->f, buf, len, s->off + s->s.pos))
+		return false;
+	*nread = len;
+	return true;
+}
+
+static void file_stream_close(struct archive_stream *s)
+{
+	free(s);
+}
+
+static struct archive_stream_ops file_stream_ops = {
+	.read = file_stream_read,
+	.seek = NULL,
+	.close = file_stream_close,
+};
+
+struct archive_stream *_archive_open_file_stream(struct archive *ar, int no, FILE *f,
+		const uint8_t *map, size_t off, size_t size)
+{
+	struct file_stream *s = xcalloc(1, sizeof(struct file_stream));
+	s->s.ops = &file_stream_ops;
+	s->s.archive = ar;
+	s->s.no = no;
+	s->s.size = size;
+	s->f = f;
+	s->map = map;
+	s->off = off;
+	return &s->s;
+}
+
+struct data_stream {
+	struct archive_stream s;
+	struct archive_data *data;
+};
+
+static bool data_stream_read(struct archive_stream *_s, uint8_t *buf, size_t len, size_t *nread)
+{
+	struct data_stream *s = (struct data_stream*)_s;
+	memcpy(buf, s->data->data + s->s.pos, len);
+	*nread = len;
+	return true;
+}
+
+static void data_stream_close(struct archive_stream *_s)
+{
+	struct data_stream *s = (struct data_stream*)_s;
+	archive_free_data(s->data);
+	free(s);
+}
+
+static struct archive_stream_ops data_stream_ops = {
+	.read = data_stream_read,
+	.seek = NULL,
+	.close = data_stream_close,
+};
+
+struct archive_stream *_archive_open_data_stream(struct archive_data *data)
+{
+	struct data_stream *s = xcalloc(1, sizeof(struct data_stream));
+	s->s.ops = &data_stream_ops;
+	s->s.archive = data->archive;
+	s->s.no = data->no;
+	s->s.size = data->size;
+	s->data = data;
+	return &s->s;
+}
+
+struct archive_stream *archive_open_stream(struct archive *ar, int no)
+{
+	if (ar->ops->open_stream)
+		return ar->ops->open_stream(ar, no);
+
+	struct archive_data *data = archive_get(ar, no);
+	if (!data)
+		return NULL;
+	return _archive_open_data_stream(data);
+}
+
+bool archive_stream_read(struct archive_stream *s, void *buf, size_t len, size_t *nread)
+{
+	len = min(len, s->size - s->pos);
+	if (!len) {
+		*nread = 0;
+		return true;
+	}
+	size_t n;
+	if (!s->ops->read(s, buf, len, &n))
+		return false;
+	s->pos += n;
+	*nread = n;
+	return true;
+}
+
+bool archive_stream_seek(struct archive_stream *s, int64_t offset, int whence)
+{
+	int64_t pos;
+	switch (whence) {
+	case SEEK_SET: pos = offset; break;
+	case SEEK_CUR: pos = (int64_t)s->pos + offset; break;
+	case SEEK_END: pos = (int64_t)s->size + offset; break;
+	default: return false;
+	}
+	if (pos < 0 || (uint64_t)pos > s->size)
+		return false;
+	if (s->ops->seek && !s->ops->seek(s, pos))
+		return false;
+	s->pos = pos;
+	return true;
+}
+
+void archive_stream_close(struct archive_stream *s)
+{
+	s->ops->close(s);
+}
+
 /*
  * Default implementation for `archive_copy_descriptor`.
  * If the archive implementation extends the `archive_data` structure,
@@ -61,6 +210,153 @@ struct archive_data *_archive_copy_descriptor(struct archive_data *src)
 	return dst;
 }
 
+kv_decl(descriptor_list, struct archive_data*);
+
+struct parallel_state {
+	descriptor_list descriptors;
+	struct archive_for_each_result *results;
+	atomic_size_t next;
+	bool (*iter)(struct archive_data *data, void *user);
+	void *user;
+};
+
+static void collect_descriptor(struct archive_data *data, void *user)
+{
+	descriptor_list *list = user;
+	kv_push(struct archive_data*, *list, archive_copy_descriptor(data));
+}
+
+static void *parallel_worker(void *_state)
+{
+	struct parallel_state *state = _state;
+	size_t i;
+	while ((i = atomic_fetch_add(&state->next, 1)) < kv_size(state->descriptors)) {
+		struct archive_data *data = kv_A(state->descriptors, i);
+		struct archive_for_each_result *result = &state->results[i];
+		result->no = data->no;
+		if (!archive_load_file(data)) {
+			result->status = ARCHIVE_ENTRY_LOAD_ERROR;
+		} else {
+			if (state->iter(data, state->user))
+				result->status = ARCHIVE_ENTRY_OK;
+			else
+				result->status = ARCHIVE_ENTRY_ITER_ERROR;
+			archive_release_file(data);
+		}
+		archive_free_data(data);
+	}
+	return NULL;
+}
+
+size_t archive_for_each_parallel(struct archive *ar, int nr_threads,
+		bool (*iter)(struct archive_data *data, void *user), void *user,
+		struct archive_for_each_result **results_out)
+{
+	struct parallel_state state = { .iter = iter, .user = user };
+	kv_init(state.descriptors);
+	atomic_init(&state.next, 0);
+	archive_for_each(ar, collect_descriptor, &state.descriptors);
+
+	size_t nr_entries = kv_size(state.descriptors);
+	state.results = xcalloc(max(nr_entries, (size_t)1), sizeof(struct archive_for_each_result));
+
+	// the calling thread acts as one of the workers
+	int nr_workers = min((size_t)max(nr_threads, 1), max(nr_entries, (size_t)1)) - 1;
+	pthread_t *workers = xcalloc(max(nr_workers, 1), sizeof(pthread_t));
+	int nr_started = 0;
+	for (; nr_started < nr_workers; nr_started++) {
+		if (pthread_create(&workers[nr_started], NULL, parallel_worker, &state)) {
+			WARNING("pthread_create failed");
+			break;
+		}
+	}
+	parallel_worker(&state);
+	for (int i = 0; i < nr_started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	free(workers);
+	kv_destroy(state.descriptors);
+	if (results_out)
+		*results_out = state.results;
+	else
+		free(state.results);
+	return nr_entries;
+}
+
+struct archive_cache {
+	struct lru_cache lru;
+};
+
+void archive_enable_cache(struct archive *ar, size_t budget)
+{
+	if (ar->cache) {
+		lru_cache_set_budget(&ar->cache->lru, budget);
+		return;
+	}
+	struct archive_cache *cache = xmalloc(sizeof(struct archive_cache));
+	lru_cache_init(&cache->lru, budget, 1024, free);
+	ar->cache = cache;
+}
+
+bool archive_get_cache_stats(struct archive *ar, struct archive_cache_stats *out)
+{
+	if (!ar->cache)
+		return false;
+	struct lru_cache_stats s;
+	lru_cache_get_stats(&ar->cache->lru, &s);
+	*out = (struct archive_cache_stats) {
+		.hits = s.hits,
+		.misses = s.misses,
+		.evictions = s.evictions,
+		.nr_entries = s.nr_entries,
+		.bytes = s.bytes,
+		.budget = s.budget,
+	};
+	return true;
+}
+
+uint8_t *_archive_cache_get(struct archive *ar, int key, size_t *size_out)
+{
+	return lru_cache_get(&ar->cache->lru, key, size_out);
+}
+
+uint8_t *_archive_cache_put(struct archive *ar, int key, uint8_t *data, size_t size)
+{
+	return lru_cache_put(&ar->cache->lru, key, data, size);
+}
+
+void _archive_cache_release(struct archive *ar, int key, uint8_t *data)
+{
+	lru_cache_release(&ar->cache->lru, key, data);
+}
+
+void _archive_free_cache(struct archive *ar)
+{
+	lru_cache_fini(&ar->cache->lru);
+	free(ar->cache);
+	ar->cache = NULL;
+}
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct hash_table *_archive_lazy_index(struct archive *ar, struct hash_table **index,
+		struct hash_table *(*build)(struct archive *ar))
+{
+	struct hash_table *ht = __atomic_load_n(index, __ATOMIC_ACQUIRE);
+	if (ht)
+		return ht;
+
+	// indices are built once per archive, so one lock for all of them will do
+	pthread_mutex_lock(&index_lock);
+	if (!(ht = *index)) {
+		ht = build(ar);
+		__atomic_store_n(index, ht, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&index_lock);
+	return ht;
+}
+
 // FIXME?: assumes ASCII-compatible encoding
 char *archive_basename(const char *name)
 {
@@ -17,8 +17,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include "little_endian.h"
 #include "system4.h"
 #include "system4/archive.h"
+#include "system4/buffer.h"
 #include "system4/cg.h"
 #include "system4/file.h"
 #include "system4/ajp.h"
@@ -29,6 +32,12 @@
 #include "system4/png.h"
 #include "system4/qnt.h"
 #include "system4/webp.h"
+#include "cg_decoder.h"
+#include "pixel_conv.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 const char *cg_file_extensions[_ALCG_NR_FORMATS] = {
 	[ALCG_UNKNOWN] = "",
@@ -112,9 +121,139 @@ bool cg_get_metrics_data(struct archive_data *dfile, struct cg_metrics *dst)
 	return cg_get_metrics_internal(dfile->data, dfile->size, dst);
 }
 
+/*
+ * Number of bytes read from the start of a CG before its format is known.
+ * This covers the fixed-size headers of all supported formats.
+ */
+#define CG_METRICS_PEEK_SIZE 256
+/*
+ * Headers larger than this are parsed from a fully loaded file instead.
+ */
+#define CG_METRICS_MAX_HEADER_SIZE (1024*1024)
+
+static uint32_t get_be32(const uint8_t *b)
+{
+	return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+/*
+ * Get the number of bytes needed to parse the metrics of a CG, given the
+ * first `size` bytes of it. If the result is larger than `size`, more data
+ * must be read and this function called again. Returns 0 if the header size
+ * can't be determined this way.
+ */
+static size_t cg_metrics_header_size(uint8_t *buf, size_t size)
+{
+	size_t pos;
+
+	switch (cg_check_format(buf)) {
+	case ALCG_QNT:
+	case ALCG_PMS8:
+	case ALCG_PMS16:
+		return 48;
+	case ALCG_PNG:
+		// png_read_info reads up to the header of the first IDAT chunk
+		for (pos = 8; pos + 8 <= size; pos += 12 + (size_t)get_be32(buf + pos)) {
+			if (!memcmp(buf + pos + 4, "IDAT", 4))
+				return pos + 8;
+		}
+		return pos + 8;
+	case ALCG_WEBP:
+		// skip optional chunks up to the VP8/VP8L bitstream header
+		for (pos = 12; pos + 8 <= size; pos += 8 + (((size_t)LittleEndian_getDW(buf, pos + 4) + 1) & ~1)) {
+			if (!memcmp(buf + pos, "VP8 ", 4) || !memcmp(buf + pos, "VP8L", 4))
+				return pos + 18;
+		}
+		return pos + 8;
+	case ALCG_JPEG:
+		// tjDecompressHeader2 reads markers up to the start of scan
+		for (pos = 2; pos + 4 <= size; ) {
+			if (buf[pos] != 0xff)
+				return 0;
+			uint8_t marker = buf[pos + 1];
+			if (marker == 0xff) {
+				pos++;
+				continue;
+			}
+			if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+				pos += 2;
+				continue;
+			}
+			if (marker == 0xd9)
+				return 0;
+			size_t seg_end = pos + 2 + (buf[pos + 2] << 8 | buf[pos + 3]);
+			if (marker == 0xda)
+				return seg_end;
+			pos = seg_end;
+		}
+		return pos + 4;
+	case ALCG_DCF:
+		// "dcf " and "dfdl" chunks, then a "dcgd" chunk holding a QNT
+		if (size < 8)
+			return 8;
+		pos = 8 + (uint32_t)LittleEndian_getDW(buf, 4);
+		if (size < pos + 8)
+			return pos + 8;
+		pos += 8 + (uint32_t)LittleEndian_getDW(buf, pos + 4);
+		return pos + 8 + 48;
+	case ALCG_PCF:
+		if (size < 8)
+			return 8;
+		return 8 + (uint32_t)LittleEndian_getDW(buf, 4);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Read just enough of a CG to parse its metrics. Returns false if the header
+ * size couldn't be determined, in which case the whole file must be loaded.
+ * Otherwise the result of the metrics parser is stored in `result`.
+ */
+static bool cg_get_metrics_partial(struct archive *ar, int no, struct cg_metrics *dst, bool *result)
+{
+	size_t buf_size = CG_METRICS_PEEK_SIZE;
+	uint8_t *buf = xcalloc(1, buf_size);
+	size_t nread;
+	bool handled = true;
+
+	if (!archive_peek(ar, no, buf, buf_size, &nread)) {
+		*result = false;
+		goto out;
+	}
+	for (;;) {
+		size_t need = cg_metrics_header_size(buf, nread);
+		// file is too short or header size is unknown
+		if (!need || need > CG_METRICS_MAX_HEADER_SIZE || (need > nread && nread < buf_size)) {
+			handled = false;
+			goto out;
+		}
+		if (need <= nread) {
+			*result = cg_get_metrics_internal(buf, nread, dst);
+			goto out;
+		}
+
+		size_t more;
+		buf = xrealloc(buf, need);
+		buf_size = need;
+		if (!archive_read_range(ar, no, nread, need - nread, buf + nread, &more)) {
+			*result = false;
+			goto out;
+		}
+		nread += more;
+	}
+out:
+	free(buf);
+	return handled;
+}
+
 bool cg_get_metrics(struct archive *ar, int no, struct cg_metrics *dst)
 {
 	struct archive_data *dfile;
+	bool result;
+
+	if (cg_get_metrics_partial(ar, no, dst, &result))
+		return result;
 
 	if (!(dfile = archive_get(ar, no)))
 		return false;
@@ -124,6 +263,64 @@ bool cg_get_metrics(struct archive *ar, int no, struct cg_metrics *dst)
 	return r;
 }
 
+void cg_set_collect_alpha_info(bool enable)
+{
+	cg_decoder_ctx_get()->collect_alpha_info = enable;
+}
+
+struct pixel_alpha_stats *cg_alpha_stats_begin(struct pixel_alpha_stats *s, int w)
+{
+	if (!cg_decoder_ctx_get()->collect_alpha_info)
+		return NULL;
+	pixel_alpha_stats_init(s, w);
+	return s;
+}
+
+void cg_alpha_stats_end(struct cg *cg, const struct pixel_alpha_stats *s)
+{
+	// a decoder that gave up early leaves the rest to cg_get_alpha_info
+	if (!s || s->w != cg->metrics.w || s->pos != (size_t)cg->metrics.w * cg->metrics.h)
+		return;
+
+	struct cg_alpha_info *info = &cg->alpha_info;
+	info->opaque = s->min == 0xff;
+	info->transparent = s->max == 0;
+	info->binary = !s->partial;
+	if (s->x0 < s->x1) {
+		info->x = s->x0;
+		info->y = s->y0;
+		info->w = s->x1 - s->x0;
+		info->h = s->y1 - s->y0;
+	} else {
+		info->x = info->y = info->w = info->h = 0;
+	}
+	cg->has_alpha_info = true;
+}
+
+void cg_set_opaque(struct cg *cg)
+{
+	cg->alpha_info = (struct cg_alpha_info) {
+		.opaque = true,
+		.binary = true,
+		.w = cg->metrics.w,
+		.h = cg->metrics.h,
+	};
+	cg->has_alpha_info = true;
+}
+
+const struct cg_alpha_info *cg_get_alpha_info(struct cg *cg)
+{
+	if (!cg->pixels)
+		return NULL;
+	if (!cg->has_alpha_info) {
+		struct pixel_alpha_stats s;
+		pixel_alpha_stats_init(&s, cg->metrics.w);
+		pixel_alpha_stats_add(&s, (uint8_t*)cg->pixels + 3, 4, (size_t)cg->metrics.w * cg->metrics.h);
+		cg_alpha_stats_end(cg, &s);
+	}
+	return &cg->alpha_info;
+}
+
 /*
  * Free CG data
  *  cg: object to free
@@ -216,6 +413,417 @@ struct cg *cg_load_buffer(uint8_t *buf, size_t buf_size)
 	return cg_load_internal(buf, buf_size, NULL);
 }
 
+/*
+ * Crop a CG to the region (x, y, w, h), which must lie within it.
+ */
+void cg_crop(struct cg *cg, int x, int y, int w, int h)
+{
+	if (x == 0 && y == 0 && w == cg->metrics.w && h == cg->metrics.h)
+		return;
+
+	uint8_t *src = cg->pixels;
+	uint8_t *dst = xmalloc((size_t)w * h * 4);
+	for (int row = 0; row < h; row++) {
+		memcpy(dst + (size_t)row * w * 4, src + ((size_t)(y + row) * cg->metrics.w + x) * 4, w * 4);
+	}
+	free(cg->pixels);
+	cg->pixels = dst;
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	if (cg->has_alpha_info && cg->alpha_info.opaque)
+		cg_set_opaque(cg);
+	else
+		cg->has_alpha_info = false;
+}
+
+/*
+ * Clip the region (x, y, w, h) to a w*h image. Returns false if nothing is
+ * left.
+ */
+static bool cg_clip_rect(int image_w, int image_h, int *x, int *y, int *w, int *h)
+{
+	int x0 = max(*x, 0), y0 = max(*y, 0);
+	int x1 = min((int64_t)*x + *w, (int64_t)image_w);
+	int y1 = min((int64_t)*y + *h, (int64_t)image_h);
+	if (x0 >= x1 || y0 >= y1) {
+		WARNING("CG region (%d,%d,%d,%d) outside of %dx%d image", *x, *y, *w, *h, image_w, image_h);
+		return false;
+	}
+	*x = x0;
+	*y = y0;
+	*w = x1 - x0;
+	*h = y1 - y0;
+	return true;
+}
+
+static struct cg *cg_load_rect_internal(uint8_t *buf, size_t buf_size, struct archive *ar,
+		int x, int y, int w, int h)
+{
+	struct cg *cg;
+	struct cg_metrics m = {0};
+	enum cg_type type = cg_check_format(buf);
+
+	// JPEG, WebP, PNG and PMS can skip (some of) the work outside the
+	// region; everything else is decoded in full and cropped
+	if (type != ALCG_JPEG && type != ALCG_WEBP && type != ALCG_PNG
+			&& type != ALCG_PMS8 && type != ALCG_PMS16) {
+		if (!(cg = cg_load_internal(buf, buf_size, ar)))
+			return NULL;
+		if (!cg_clip_rect(cg->metrics.w, cg->metrics.h, &x, &y, &w, &h)) {
+			cg_free(cg);
+			return NULL;
+		}
+		cg_crop(cg, x, y, w, h);
+		return cg;
+	}
+
+	if (!cg_get_metrics_internal(buf, buf_size, &m))
+		return NULL;
+	if (!cg_clip_rect(m.w, m.h, &x, &y, &w, &h))
+		return NULL;
+
+	cg = xcalloc(1, sizeof(struct cg));
+	switch (type) {
+	case ALCG_JPEG:
+		jpeg_cg_extract_rect(buf, buf_size, cg, x, y, w, h);
+		break;
+	case ALCG_WEBP:
+		webp_extract_rect(buf, buf_size, cg, ar, x, y, w, h);
+		break;
+	case ALCG_PNG:
+		png_cg_extract_rect(buf, buf_size, cg, x, y, w, h);
+		break;
+	default:
+		pms_extract_rect(buf, buf_size, cg, x, y, w, h);
+		break;
+	}
+	if (cg->pixels)
+		return cg;
+	free(cg);
+	return NULL;
+}
+
+/*
+ * Load the region (x, y, w, h) of a CG, clipped to the image. Only the region
+ * is allocated, and formats that allow it skip decoding (some of) the rest.
+ * Returns NULL if the region lies outside the image.
+ */
+struct cg *cg_load_rect(uint8_t *buf, size_t buf_size, int x, int y, int w, int h)
+{
+	return cg_load_rect_internal(buf, buf_size, NULL, x, y, w, h);
+}
+
+struct cg *cg_load_data_rect(struct archive_data *dfile, int x, int y, int w, int h)
+{
+	return cg_load_rect_internal(dfile->data, dfile->size, dfile->archive, x, y, w, h);
+}
+
+/*
+ * Get the size of a w*h image scaled down to fit in max_w*max_h, keeping its
+ * aspect ratio. Images that already fit keep their size.
+ */
+void cg_get_scaled_size(int w, int h, int max_w, int max_h, int *w_out, int *h_out)
+{
+	if (w <= max_w && h <= max_h) {
+		*w_out = w;
+		*h_out = h;
+	} else if ((int64_t)w * max_h > (int64_t)h * max_w) {
+		*w_out = max_w;
+		*h_out = max((int64_t)h * max_w / w, (int64_t)1);
+	} else {
+		*w_out = max((int64_t)w * max_h / h, (int64_t)1);
+		*h_out = max_h;
+	}
+}
+
+/*
+ * Add the premultiplied pixels of a row to the column sums in `col`.
+ */
+static void reduce_add_row(uint32_t *col, const uint8_t *p, int n)
+{
+	int x = 0;
+#ifdef __SSE2__
+	// two pixels at a time; (c * a) fits in 16 bits
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha_lanes = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	const __m128i one = _mm_set_epi16(1, 0, 0, 0, 1, 0, 0, 0);
+	for (; x + 2 <= n; x += 2, p += 8, col += 8) {
+		__m128i px = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+		__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(px, 0xff), 0xff);
+		a = _mm_or_si128(_mm_andnot_si128(alpha_lanes, a), one);
+		__m128i m = _mm_mullo_epi16(px, a);
+		__m128i *c = (__m128i*)col;
+		_mm_storeu_si128(c, _mm_add_epi32(_mm_loadu_si128(c), _mm_unpacklo_epi16(m, zero)));
+		_mm_storeu_si128(c + 1, _mm_add_epi32(_mm_loadu_si128(c + 1), _mm_unpackhi_epi16(m, zero)));
+	}
+#endif
+	for (; x < n; x++, p += 4, col += 4) {
+		uint32_t a = p[3];
+		col[0] += p[0] * a;
+		col[1] += p[1] * a;
+		col[2] += p[2] * a;
+		col[3] += a;
+	}
+}
+
+/*
+ * Shrink a CG to w*h. Each destination pixel is the alpha-weighted average of
+ * the source pixels it covers, so that the colour of transparent pixels doesn't
+ * bleed into the result.
+ */
+static void cg_reduce(struct cg *cg, int w, int h)
+{
+	int sw = cg->metrics.w, sh = cg->metrics.h;
+	if (w == sw && h == sh)
+		return;
+	// a column sum adds up to 255*255 per row, and must fit in 32 bits
+	if ((uint32_t)(sh / h) + 1 > UINT32_MAX / (255 * 255)) {
+		WARNING("CG too tall to scale: %dx%d -> %dx%d", sw, sh, w, h);
+		return;
+	}
+
+	const uint8_t *src = cg->pixels;
+	uint8_t *dst = xmalloc((size_t)w * h * 4);
+	// premultiplied column sums of the source rows covered by a destination row
+	uint32_t *col = xmalloc((size_t)sw * 4 * sizeof(uint32_t));
+	int *x0 = xmalloc((w + 1) * sizeof(int));
+	for (int x = 0; x <= w; x++) {
+		x0[x] = (int64_t)x * sw / w;
+	}
+
+	for (int y = 0; y < h; y++) {
+		int y0 = (int64_t)y * sh / h, y1 = (int64_t)(y + 1) * sh / h;
+		uint64_t box_h = y1 - y0;
+		memset(col, 0, (size_t)sw * 4 * sizeof(uint32_t));
+		for (int sy = y0; sy < y1; sy++) {
+			reduce_add_row(col, src + (size_t)sy * sw * 4, sw);
+		}
+		uint8_t *out = dst + (size_t)y * w * 4;
+		for (int x = 0; x < w; x++, out += 4) {
+			uint64_t s[4] = {0};
+			for (const uint32_t *c = col + x0[x] * 4; c < col + x0[x+1] * 4; c += 4) {
+				s[0] += c[0];
+				s[1] += c[1];
+				s[2] += c[2];
+				s[3] += c[3];
+			}
+			if (!s[3]) {
+				memset(out, 0, 4);
+				continue;
+			}
+			uint64_t n = (x0[x+1] - x0[x]) * box_h;
+			out[0] = (s[0] + s[3] / 2) / s[3];
+			out[1] = (s[1] + s[3] / 2) / s[3];
+			out[2] = (s[2] + s[3] / 2) / s[3];
+			out[3] = (s[3] + n / 2) / n;
+		}
+	}
+
+	free(x0);
+	free(col);
+	free(cg->pixels);
+	cg->pixels = dst;
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	cg->has_alpha_info = false;
+}
+
+static struct cg *cg_load_scaled_internal(uint8_t *buf, size_t buf_size, struct archive *ar,
+		int max_w, int max_h)
+{
+	struct cg *cg;
+	if (max_w <= 0 || max_h <= 0) {
+		WARNING("Invalid CG scale size: %dx%d", max_w, max_h);
+		return NULL;
+	}
+
+	// JPEG, AJP and WebP can decode at reduced size; everything else is
+	// decoded in full and averaged down
+	switch (cg_check_format(buf)) {
+	case ALCG_AJP:
+		cg = xcalloc(1, sizeof(struct cg));
+		ajp_extract_scaled(buf, buf_size, cg, max_w, max_h);
+		break;
+	case ALCG_WEBP:
+		cg = xcalloc(1, sizeof(struct cg));
+		webp_extract_scaled(buf, buf_size, cg, ar, max_w, max_h);
+		break;
+	case ALCG_JPEG:
+		cg = xcalloc(1, sizeof(struct cg));
+		jpeg_cg_extract_scaled(buf, buf_size, cg, max_w, max_h);
+		break;
+	default:
+		cg = cg_load_internal(buf, buf_size, ar);
+		break;
+	}
+	if (!cg)
+		return NULL;
+	if (!cg->pixels) {
+		free(cg);
+		return NULL;
+	}
+
+	int w, h;
+	cg_get_scaled_size(cg->metrics.w, cg->metrics.h, max_w, max_h, &w, &h);
+	cg_reduce(cg, w, h);
+	return cg;
+}
+
+/*
+ * Load a CG scaled down to fit in max_w*max_h (e.g. for a thumbnail). The
+ * aspect ratio is kept, and CGs that already fit are loaded at full size.
+ */
+struct cg *cg_load_scaled(struct archive *ar, int no, int max_w, int max_h)
+{
+	struct cg *cg;
+	struct archive_data *dfile;
+
+	if (!(dfile = archive_get(ar, no))) {
+		WARNING("Failed to load CG %d", no);
+		return NULL;
+	}
+
+	cg = cg_load_data_scaled(dfile, max_w, max_h);
+	archive_free_data(dfile);
+	return cg;
+}
+
+struct cg *cg_load_data_scaled(struct archive_data *dfile, int max_w, int max_h)
+{
+	return cg_load_scaled_internal(dfile->data, dfile->size, dfile->archive, max_w, max_h);
+}
+
+/*
+ * Convert RGBA pixels to `fmt`, in place.
+ */
+static void cg_convert_pixels(uint8_t *pixels, size_t stride, int w, int h, enum cg_pixel_format fmt)
+{
+	switch (fmt) {
+	case CG_PIXEL_RGBA:
+		break;
+	case CG_PIXEL_BGRA:
+		for (int y = 0; y < h; y++)
+			pixel_swap_rb(pixels + y * stride, w);
+		break;
+	case CG_PIXEL_RGBA_PREMULTIPLIED:
+		for (int y = 0; y < h; y++)
+			pixel_premultiply(pixels + y * stride, w);
+		break;
+	}
+}
+
+/*
+ * Check that `h` rows of `w` pixels, `stride` bytes apart, fit in `dst_size`
+ * bytes.
+ */
+static bool cg_dst_fits(const struct cg_metrics *m, size_t dst_size, size_t stride)
+{
+	if (m->w < 0 || m->h < 0)
+		return false;
+	size_t row = (size_t)m->w * 4;
+	if (stride < row)
+		return false;
+	if (!m->h || !row)
+		return true;
+	return dst_size >= row && (size_t)(m->h - 1) <= (dst_size - row) / stride;
+}
+
+static bool cg_load_into_internal(uint8_t *buf, size_t buf_size, struct archive *ar,
+		uint8_t *dst, size_t dst_size, size_t stride, enum cg_pixel_format fmt)
+{
+	struct cg_metrics m;
+	struct cg *cg = NULL;
+	enum cg_type type = cg_check_format(buf);
+	bool r;
+
+	memset(&m, 0, sizeof(m));
+	switch (type) {
+	case ALCG_QNT:
+		r = qnt_get_metrics(buf, &m);
+		break;
+	case ALCG_PNG:
+		r = png_cg_get_metrics(buf, buf_size, &m);
+		break;
+	case ALCG_WEBP:
+		webp_get_metrics(buf, buf_size, &m);
+		r = true;
+		break;
+	case ALCG_JPEG:
+		r = jpeg_cg_get_metrics(buf, buf_size, &m);
+		break;
+	case ALCG_DCF:
+		dcf_get_metrics(buf, buf_size, &m);
+		r = true;
+		break;
+	default:
+		// no direct path for this format: decode and copy
+		cg = cg_load_internal(buf, buf_size, ar);
+		if (!cg)
+			return false;
+		m = cg->metrics;
+		r = true;
+		break;
+	}
+	if (!r)
+		return false;
+	if (!cg_dst_fits(&m, dst_size, stride)) {
+		WARNING("CG (%dx%d) does not fit in destination buffer (%zu bytes, stride %zu)",
+				m.w, m.h, dst_size, stride);
+		cg_free(cg);
+		return false;
+	}
+
+	// the direct paths store BGRA themselves, so that only premultiplied
+	// alpha and the copied formats need another pass over `dst`
+	bool bgr = fmt == CG_PIXEL_BGRA;
+	switch (type) {
+	case ALCG_QNT:
+		r = qnt_extract_into(buf, dst, stride, bgr);
+		break;
+	case ALCG_PNG:
+		r = png_cg_extract_into(buf, buf_size, dst, stride, bgr);
+		break;
+	case ALCG_WEBP:
+		r = webp_extract_into(buf, buf_size, dst, stride, bgr, ar);
+		break;
+	case ALCG_JPEG:
+		r = jpeg_cg_extract_into(buf, buf_size, dst, stride, bgr);
+		break;
+	case ALCG_DCF:
+		r = dcf_extract_into(buf, buf_size, dst, stride, bgr, ar);
+		break;
+	default:
+		for (int y = 0; y < m.h; y++)
+			memcpy(dst + y * stride, (uint8_t*)cg->pixels + (size_t)y * m.w * 4, m.w * 4);
+		cg_free(cg);
+		bgr = false; // copied as RGBA
+		break;
+	}
+	if (r && !bgr)
+		cg_convert_pixels(dst, stride, m.w, m.h, fmt);
+	return r;
+}
+
+/*
+ * Decode a CG into caller-provided memory, without an intermediate buffer
+ * where the format allows it (QNT, PNG, WebP, JPEG, DCF). `dst` must hold `h`
+ * rows of `stride` bytes (see cg_get_metrics); it must be 4-byte aligned, and
+ * `stride` a multiple of 4, at least w*4. Fails without writing anything if
+ * the image does not fit in the `dst_size` bytes at `dst`.
+ */
+bool cg_load_data_into(struct archive_data *dfile, uint8_t *dst, size_t dst_size, size_t stride,
+		enum cg_pixel_format fmt)
+{
+	return cg_load_into_internal(dfile->data, dfile->size, dfile->archive, dst, dst_size,
+			stride, fmt);
+}
+
+bool cg_load_into(uint8_t *buf, size_t buf_size, uint8_t *dst, size_t dst_size, size_t stride,
+		enum cg_pixel_format fmt)
+{
+	return cg_load_into_internal(buf, buf_size, NULL, dst, dst_size, stride, fmt);
+}
+
 int cg_write(struct cg *cg, enum cg_type type, FILE *f)
 {
 	switch (type) {
@@ -230,3 +838,57 @@ int cg_write(struct cg *cg, enum cg_type type, FILE *f)
 	}
 	return 0;
 }
+
+/*
+ * Encode a CG into memory.
+ *
+ * If *buf is NULL, the output is written to a newly allocated buffer, which
+ * the caller must free(). Otherwise *buf must point to a buffer of *size
+ * bytes; if the encoded CG doesn't fit, false is returned and *size is set to
+ * the required size. On success, *size is set to the size of the encoded CG.
+ */
+bool cg_encode(struct cg *cg, enum cg_type type, const struct cg_encode_options *opts,
+		uint8_t **buf, size_t *size)
+{
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+
+	int r = 0;
+	switch (type) {
+	case ALCG_QNT:
+		r = qnt_encode(cg, opts ? opts->qnt : NULL, &out);
+		break;
+	case ALCG_PNG:
+		r = png_cg_encode(cg, &out);
+		break;
+	case ALCG_WEBP:
+		r = webp_encode(cg, &out);
+		break;
+	default:
+		WARNING("encoding not supported for CG type");
+	}
+	if (!r) {
+		free(out.buf);
+		return false;
+	}
+
+	if (!*buf) {
+		*buf = out.buf;
+		*size = out.index;
+		return true;
+	}
+	bool fits = out.index <= *size;
+	if (fits)
+		memcpy(*buf, out.buf, out.index);
+	*size = out.index;
+	free(out.buf);
+	return fits;
+}
+
+uint8_t *cg_write_buffer(struct cg *cg, enum cg_type type, size_t *size)
+{
+	uint8_t *buf = NULL;
+	if (!cg_encode(cg, type, NULL, &buf, size))
+		return NULL;
+	return buf;
+}
@@ -0,0 +1,135 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "system4.h"
+#include "system4/archive.h"
+#include "system4/cg.h"
+
+#include "cg_decoder.h"
+#include "lru_cache.h"
+
+struct cg_cache {
+	struct lru_cache lru;
+};
+
+static void free_cached_cg(void *cg)
+{
+	cg_free(cg);
+}
+
+static void free_cg_cache(void *_cache)
+{
+	struct cg_cache *cache = _cache;
+	lru_cache_fini(&cache->lru);
+	free(cache);
+}
+
+/* Get the base CG cache of an archive, or NULL if it isn't enabled. */
+static struct cg_cache *get_cache(struct archive *ar)
+{
+	return ar->free_user_cache == free_cg_cache ? ar->user_cache : NULL;
+}
+
+void cg_enable_base_cache(struct archive *ar, size_t budget)
+{
+	struct cg_cache *cache = get_cache(ar);
+	if (cache) {
+		lru_cache_set_budget(&cache->lru, budget);
+		return;
+	}
+	if (ar->free_user_cache) {
+		WARNING("Archive already has a cache of another kind");
+		return;
+	}
+	cache = xmalloc(sizeof(struct cg_cache));
+	lru_cache_init(&cache->lru, budget, 256, free_cached_cg);
+	ar->user_cache = cache;
+	ar->free_user_cache = free_cg_cache;
+}
+
+bool cg_get_base_cache_stats(struct archive *ar, struct cg_cache_stats *out)
+{
+	struct cg_cache *cache = get_cache(ar);
+	if (!cache)
+		return false;
+	struct lru_cache_stats s;
+	lru_cache_get_stats(&cache->lru, &s);
+	*out = (struct cg_cache_stats) {
+		.hits = s.hits,
+		.misses = s.misses,
+		.evictions = s.evictions,
+		.nr_entries = s.nr_entries,
+		.bytes = s.bytes,
+		.budget = s.budget,
+	};
+	return true;
+}
+
+/*
+ * Insert a freshly decoded CG. Returns the shared CG, which may differ from
+ * `cg` if another thread got there first. If `cg` is too large to be cached
+ * it is returned as-is and remains owned by the caller.
+ */
+static struct cg *cache_put(struct cg_cache *cache, int no, struct cg *cg)
+{
+	size_t size = (size_t)cg->metrics.w * cg->metrics.h * 4;
+	struct cg *shared = lru_cache_put(&cache->lru, no, cg, size);
+	return shared ? shared : cg;
+}
+
+struct cg *_cg_load_base(struct archive *ar, int no)
+{
+	struct cg_decoder_ctx *ctx = cg_decoder_ctx_get();
+	for (int i = 0; i < ctx->base_depth; i++) {
+		if (ctx->base_chain[i].ar == ar && ctx->base_chain[i].no == no) {
+			WARNING("Recursive base CG chain at CG %d", no);
+			return NULL;
+		}
+	}
+	if (ctx->base_depth >= CG_DECODER_MAX_BASE_DEPTH) {
+		WARNING("Base CG chain too deep at CG %d", no);
+		return NULL;
+	}
+
+	struct cg_cache *cache = get_cache(ar);
+	struct cg *cg;
+	if (cache && (cg = lru_cache_get(&cache->lru, no, NULL)))
+		return cg;
+
+	ctx->base_chain[ctx->base_depth].ar = ar;
+	ctx->base_chain[ctx->base_depth].no = no;
+	ctx->base_depth++;
+	cg = cg_load(ar, no);
+	ctx->base_depth--;
+
+	if (cg && !cg->pixels) {
+		cg_free(cg);
+		return NULL;
+	}
+	if (cg && cache)
+		cg = cache_put(cache, no, cg);
+	return cg;
+}
+
+void _cg_release_base(struct archive *ar, int no, struct cg *cg)
+{
+	struct cg_cache *cache = get_cache(ar);
+	// base CGs that were too large to be cached are owned by the caller
+	if (!cache || !lru_cache_release(&cache->lru, no, cg))
+		cg_free(cg);
+}
@@ -0,0 +1,151 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <turbojpeg.h>
+#include <zlib.h>
+#include "system4.h"
+#include "cg_decoder.h"
+
+static pthread_key_t ctx_key;
+static pthread_once_t ctx_key_once = PTHREAD_ONCE_INIT;
+
+static void ctx_free(void *data)
+{
+	struct cg_decoder_ctx *ctx = data;
+	if (ctx->tj)
+		tjDestroy(ctx->tj);
+	if (ctx->tj_transform)
+		tjDestroy(ctx->tj_transform);
+	for (int i = 0; i < CG_DECODER_NR_STREAMS; i++) {
+		if (ctx->z_ready[i])
+			inflateEnd(&ctx->z[i]);
+	}
+	free(ctx->scratch);
+	free(ctx);
+}
+
+static void ctx_key_init(void)
+{
+	if (pthread_key_create(&ctx_key, ctx_free))
+		ERROR("pthread_key_create failed");
+}
+
+/*
+ * Get the calling thread's decoder context.
+ */
+struct cg_decoder_ctx *cg_decoder_ctx_get(void)
+{
+	pthread_once(&ctx_key_once, ctx_key_init);
+	struct cg_decoder_ctx *ctx = pthread_getspecific(ctx_key);
+	if (!ctx) {
+		ctx = xcalloc(1, sizeof(struct cg_decoder_ctx));
+		if (pthread_setspecific(ctx_key, ctx))
+			ERROR("pthread_setspecific failed");
+	}
+	return ctx;
+}
+
+/*
+ * Get the turbojpeg decompressor, creating it on first use. Returns NULL on
+ * failure.
+ */
+void *cg_decoder_tj(struct cg_decoder_ctx *ctx)
+{
+	if (!ctx->tj) {
+		ctx->tj = tjInitDecompress();
+		if (!ctx->tj)
+			WARNING("tjInitDecompress failed: %s", tjGetErrorStr());
+	}
+	return ctx->tj;
+}
+
+/*
+ * Get the turbojpeg transformer, creating it on first use. Returns NULL on
+ * failure.
+ */
+void *cg_decoder_tj_transform(struct cg_decoder_ctx *ctx)
+{
+	if (!ctx->tj_transform) {
+		ctx->tj_transform = tjInitTransform();
+		if (!ctx->tj_transform)
+			WARNING("tjInitTransform failed: %s", tjGetErrorStr());
+	}
+	return ctx->tj_transform;
+}
+
+/*
+ * Start inflating `in` on stream `i`. The stream is initialized on first use
+ * and reset (keeping its window allocated) afterwards. Returns NULL on failure.
+ */
+z_stream *cg_decoder_inflate(struct cg_decoder_ctx *ctx, int i, const uint8_t *in, size_t in_size)
+{
+	z_stream *z = &ctx->z[i];
+	if (!ctx->z_ready[i]) {
+		memset(z, 0, sizeof(z_stream));
+		if (inflateInit(z) != Z_OK) {
+			WARNING("inflateInit failed");
+			return NULL;
+		}
+		ctx->z_ready[i] = true;
+	} else if (inflateReset(z) != Z_OK) {
+		WARNING("inflateReset failed");
+		return NULL;
+	}
+	z->next_in = (Bytef*)in;
+	z->avail_in = in_size;
+	return z;
+}
+
+/*
+ * Equivalent to zlib's uncompress(), using the context's first stream.
+ */
+int cg_decoder_uncompress(struct cg_decoder_ctx *ctx, uint8_t *dst, unsigned long *dst_size,
+		const uint8_t *src, unsigned long src_size)
+{
+	z_stream *z = cg_decoder_inflate(ctx, 0, src, src_size);
+	if (!z)
+		return Z_MEM_ERROR;
+	z->next_out = dst;
+	z->avail_out = *dst_size;
+	int rv = inflate(z, Z_FINISH);
+	*dst_size = z->total_out;
+	if (rv == Z_STREAM_END)
+		return Z_OK;
+	if (rv == Z_NEED_DICT || (rv == Z_BUF_ERROR && z->avail_out))
+		return Z_DATA_ERROR;
+	return rv == Z_OK ? Z_BUF_ERROR : rv;
+}
+
+/*
+ * Get a scratch buffer of at least `size` bytes. Its contents are undefined,
+ * and it is only valid until the next call. This is meant for row and chunk
+ * buffers; image-sized temporaries should be allocated separately. A buffer
+ * larger than CG_DECODER_SCRATCH_KEEP is replaced by the next smaller
+ * request, so one large image doesn't stay resident for the thread's lifetime.
+ */
+uint8_t *cg_decoder_scratch(struct cg_decoder_ctx *ctx, size_t size)
+{
+	if (ctx->scratch_size < size
+			|| (ctx->scratch_size > CG_DECODER_SCRATCH_KEEP && size <= CG_DECODER_SCRATCH_KEEP)) {
+		free(ctx->scratch);
+		ctx->scratch = xmalloc(size);
+		ctx->scratch_size = size;
+	}
+	return ctx->scratch;
+}
@@ -0,0 +1,82 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef CG_DECODER_H
+#define CG_DECODER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+// number of inflate streams a decoder may have open at once
+#define CG_DECODER_NR_STREAMS 2
+// maximum length of a chain of base CGs (DCF/WebP overlays)
+#define CG_DECODER_MAX_BASE_DEPTH 8
+// largest scratch buffer kept between calls to cg_decoder_scratch
+#define CG_DECODER_SCRATCH_KEEP (1 << 20)
+
+struct archive;
+struct cg;
+struct pixel_alpha_stats;
+
+/*
+ * Per-thread decoder state, kept alive between images so that decoding many
+ * small CGs doesn't pay for library setup and teardown every time. Obtain it
+ * with cg_decoder_ctx_get(); it is freed when the thread exits.
+ *
+ * A decoder owns the context only for the duration of a single decode, so it
+ * must not be held across a call that may decode another CG.
+ */
+struct cg_decoder_ctx {
+	void *tj; // turbojpeg decompressor (tjhandle)
+	void *tj_transform; // turbojpeg transformer (tjhandle)
+	z_stream z[CG_DECODER_NR_STREAMS];
+	bool z_ready[CG_DECODER_NR_STREAMS];
+	uint8_t *scratch;
+	size_t scratch_size;
+	// base CGs currently being decoded on this thread, outermost first
+	struct {
+		struct archive *ar;
+		int no;
+	} base_chain[CG_DECODER_MAX_BASE_DEPTH];
+	int base_depth;
+	// see cg_set_collect_alpha_info
+	bool collect_alpha_info;
+};
+
+struct cg_decoder_ctx *cg_decoder_ctx_get(void);
+void *cg_decoder_tj(struct cg_decoder_ctx *ctx);
+void *cg_decoder_tj_transform(struct cg_decoder_ctx *ctx);
+z_stream *cg_decoder_inflate(struct cg_decoder_ctx *ctx, int i, const uint8_t *in, size_t in_size);
+int cg_decoder_uncompress(struct cg_decoder_ctx *ctx, uint8_t *dst, unsigned long *dst_size,
+		const uint8_t *src, unsigned long src_size);
+uint8_t *cg_decoder_scratch(struct cg_decoder_ctx *ctx, size_t size);
+
+/*
+ * Alpha statistics collected during decoding (see cg_set_collect_alpha_info).
+ * cg_alpha_stats_begin initializes `s` for a w-pixel wide image and returns
+ * it, or NULL if collection is disabled on this thread. The decoder adds every
+ * alpha value of the CG to it in order, then stores the result with
+ * cg_alpha_stats_end (which ignores NULL and incomplete statistics).
+ * Decoders that know a CG is opaque call cg_set_opaque instead, once its size
+ * is final.
+ */
+struct pixel_alpha_stats *cg_alpha_stats_begin(struct pixel_alpha_stats *s, int w);
+void cg_alpha_stats_end(struct cg *cg, const struct pixel_alpha_stats *s);
+void cg_set_opaque(struct cg *cg);
+
+#endif /* CG_DECODER_H */
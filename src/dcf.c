@@ -16,8 +16,9 @@
 
 #include <stdlib.h>
 #include <string.h>
-#include "assert.h"
+#include "cg_decoder.h"
 #include "little_endian.h"
+#include "pixel_conv.h"
 #include "system4.h"
 #include "system4/archive.h"
 #include "system4/buffer.h"
@@ -115,7 +116,8 @@ static uint8_t *dcf_read_dfdl(struct buffer *in, size_t *size_out)
 	}
 
 	uint8_t *chunk_map = xmalloc(uncompressed_size);
-	if (uncompress(chunk_map, &uncompressed_size, in->buf+in->index, dfdl_size - 4) != Z_OK) {
+	if (cg_decoder_uncompress(cg_decoder_ctx_get(), chunk_map, &uncompressed_size,
+				in->buf+in->index, dfdl_size - 4) != Z_OK) {
 		WARNING("Failed to uncompress chunk map");
 		free(chunk_map);
 		return NULL;
@@ -144,127 +146,171 @@ const uint8_t *dcf_read_dcgd(struct buffer *in, size_t *size_out)
 	return in->buf + in->index;
 }
 
-void dcf_blit(struct cg *base, struct cg *diff, int x, int y, int w, int h)
-{
-	assert(x + w <= base->metrics.w);
-	assert(y + h <= base->metrics.h);
-	const int x_off = (x % base->metrics.w) * 4;
-	const int stride = base->metrics.w * 4;
-	uint8_t *base_px = base->pixels;
-	uint8_t *diff_px = diff->pixels;
-
-	for (int row = 0; row < h; row++) {
-		int off = (stride * (row + y)) + x_off;
-		memcpy(base_px + off, diff_px + off, w * 4);
-	}
-}
-
-// FIXME: in xsystem4, this should be done in a shader
-void dcf_apply_diff(struct cg *base, struct cg *diff, const uint8_t *chunk_map, size_t chunk_map_size)
-{
-	if (base->metrics.w != diff->metrics.w) {
-		WARNING("DCF base CG width differs: %u / %u", base->metrics.w, diff->metrics.w);
-		return;
-	}
-
-	if (base->metrics.h != diff->metrics.h) {
-		WARNING("DCF base CG height differs");
-		return;
-	}
-
-	const int chunks_w = base->metrics.w / 16;
-	const int chunks_h = base->metrics.h / 16;
-	for (size_t i = 0; i < chunk_map_size; i++) {
-		if (chunk_map[i])
-			continue;
-		int chunk_x = i % chunks_w;
-		int chunk_y = i / chunks_w;
-		dcf_blit(base, diff, chunk_x * 16, chunk_y * 16, 16, 16);
-	}
-
-	// any leftover pixels that don't fit in a chunk are carried by the diff CG
-	const int remaining_w = base->metrics.w % 16;
-	const int remaining_h = base->metrics.h % 16;
-	if (remaining_w) {
-		dcf_blit(base, diff, chunks_w * 16, 0, remaining_w, base->metrics.h);
-	}
-	if (remaining_h) {
-		dcf_blit(base, diff, 0, chunks_h * 16, base->metrics.w, remaining_h);
-	}
-}
-
-static struct cg *dcf_get_base_cg(const char *name, struct archive *ar)
+static bool dcf_get_base_cg_no(const char *name, struct archive *ar, int *no)
 {
 	struct string *tmp = (ar->conv ? ar->conv : make_string)(name, strlen(name));
 	char *basename = archive_basename(tmp->text);
 	free_string(tmp);
 
-	struct archive_data *data = archive_get_by_basename(ar, basename);
+	bool found = archive_exists_by_basename(ar, basename, no);
 	free(basename);
-	if (!data)
-		return NULL;
-	struct cg *cg = cg_load_data(data);
-	archive_free_data(data);
-	return cg;
+	return found;
 }
 
-void dcf_extract(const uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
+struct dcf {
+	struct dcf_header hdr;
+	uint8_t *chunk_map;
+	size_t chunk_map_size;
+	const uint8_t *cg_data;
+	size_t cg_data_size;
+};
+
+static bool dcf_read(const uint8_t *data, size_t size, struct dcf *dcf)
 {
 	struct buffer buf;
-	struct dcf_header hdr = {0};
-	uint8_t *chunk_map = NULL;
+	memset(dcf, 0, sizeof(struct dcf));
 
 	buffer_init(&buf, (uint8_t*)data, size);
-	if (!dcf_read_header(&buf, &hdr)) {
+	if (!dcf_read_header(&buf, &dcf->hdr)) {
 		WARNING("Failed to read DCF header");
-		goto cleanup;
+		return false;
 	}
 
-	size_t chunk_map_size;
-	if (!(chunk_map = dcf_read_dfdl(&buf, &chunk_map_size))) {
+	if (!(dcf->chunk_map = dcf_read_dfdl(&buf, &dcf->chunk_map_size))) {
 		WARNING("Failed to read dfdl section of DCF file");
-		goto cleanup;
+		return false;
 	}
 
-	if (LittleEndian_getDW(chunk_map, 0) != chunk_map_size - 4) {
+	if (LittleEndian_getDW(dcf->chunk_map, 0) != dcf->chunk_map_size - 4) {
 		WARNING("Invalid size in chunk map");
-		goto cleanup;
+		return false;
 	}
 
-	size_t cg_data_size;
-	const uint8_t *cg_data = dcf_read_dcgd(&buf, &cg_data_size);
-	if (!cg_data) {
+	if (!(dcf->cg_data = dcf_read_dcgd(&buf, &dcf->cg_data_size))) {
 		WARNING("Failed to read dcgd section of DCF file");
-		goto cleanup;
+		return false;
 	}
 
-	if (!ar) {
-		qnt_extract(cg_data, cg);
-		goto cleanup;
+	if (dcf->cg_data_size < 4 || !qnt_checkfmt(dcf->cg_data)) {
+		WARNING("DCF diff CG is not a QNT");
+		return false;
+	}
+
+	return true;
+}
+
+static void dcf_fini(struct dcf *dcf)
+{
+	free(dcf->chunk_map);
+	free(dcf->hdr.base_cg_name);
+}
+
+/*
+ * Copy the 16x16 chunks that the diff leaves unchanged (those with a non-zero
+ * byte in the chunk map) from the base CG into `dst`, swapping them to BGRA if
+ * `bgr` is set. Any leftover pixels that don't fit in a chunk are carried by
+ * the diff CG.
+ */
+static void dcf_copy_base_chunks(const struct cg *base, const uint8_t *chunk_map, size_t chunk_map_size,
+		uint8_t *dst, size_t stride, bool bgr)
+{
+	const int chunks_w = base->metrics.w / 16;
+	const int chunks_h = base->metrics.h / 16;
+	const size_t base_stride = (size_t)base->metrics.w * 4;
+	const uint8_t *base_px = base->pixels;
+
+	if (chunk_map_size > (size_t)chunks_w * chunks_h) {
+		WARNING("DCF chunk map is larger than the image");
+		chunk_map_size = (size_t)chunks_w * chunks_h;
+	}
+
+	for (size_t i = 0; i < chunk_map_size;) {
+		if (!chunk_map[i]) {
+			i++;
+			continue;
+		}
+		// copy a run of unchanged chunks within a chunk row at once
+		const int chunk_x = i % chunks_w;
+		const int chunk_y = i / chunks_w;
+		int run = 1;
+		while (chunk_x + run < chunks_w && i + run < chunk_map_size
+				&& chunk_map[i + run])
+			run++;
+		const size_t x_off = chunk_x * 16 * 4;
+		for (int row = chunk_y * 16; row < chunk_y * 16 + 16; row++) {
+			memcpy(dst + row * stride + x_off, base_px + row * base_stride + x_off, run * 16 * 4);
+			if (bgr)
+				pixel_swap_rb(dst + row * stride + x_off, run * 16);
+		}
+		i += run;
 	}
+}
 
-	struct cg *base_cg = dcf_get_base_cg(hdr.base_cg_name, ar);
+// FIXME: in xsystem4, this should be done in a shader
+/*
+ * Compose the decoded diff CG in `dst` (w*h pixels, BGRA if `bgr` is set) with
+ * its base CG. If the base CG can't be loaded, the diff is left as-is.
+ */
+static void dcf_compose(struct dcf *dcf, struct archive *ar, uint8_t *dst, size_t stride, int w, int h,
+		bool bgr)
+{
+	if (!ar)
+		return;
+
+	int base_no;
+	struct cg *base_cg = NULL;
+	if (dcf_get_base_cg_no(dcf->hdr.base_cg_name, ar, &base_no))
+		base_cg = _cg_load_base(ar, base_no);
 	if (!base_cg) {
 		WARNING("Failed to load DCF base CG");
-		qnt_extract(cg_data, cg);
-		goto cleanup;
+		return;
 	}
 
-	*cg = *base_cg;
-	free(base_cg);
-
-	struct cg *diff_cg = cg_load_buffer((uint8_t*)cg_data, cg_data_size);
-	if (!diff_cg) {
-		WARNING("Failed to load DCF diff CG");
-		goto cleanup;
+	if (base_cg->metrics.w != w) {
+		WARNING("DCF base CG width differs: %u / %u", base_cg->metrics.w, w);
+	} else if (base_cg->metrics.h != h) {
+		WARNING("DCF base CG height differs");
+	} else {
+		dcf_copy_base_chunks(base_cg, dcf->chunk_map + 4, dcf->chunk_map_size - 4, dst, stride, bgr);
 	}
+	_cg_release_base(ar, base_no, base_cg);
+}
 
-	dcf_apply_diff(cg, diff_cg, chunk_map + 4, chunk_map_size - 4);
-	cg_free(diff_cg);
+/*
+ * The diff CG is decoded straight into the output and the unchanged chunks
+ * are then filled in from the base CG, which is only read. Since QNT pixels
+ * are predicted from their neighbours, the diff can't skip decoding the chunks
+ * it doesn't change.
+ *
+ * Without the base CG cache, the base is still decoded into a buffer of its
+ * own while the output is alive, so peak memory is two full-size images. Only
+ * with cg_enable_base_cache (where the base is shared) or cg_load_into (where
+ * the output belongs to the caller) does a decode allocate just one.
+ */
+void dcf_extract(const uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
+{
+	struct dcf dcf;
+	if (dcf_read(data, size, &dcf)) {
+		qnt_extract(dcf.cg_data, cg);
+		if (cg->pixels)
+			dcf_compose(&dcf, ar, cg->pixels, cg->metrics.w * 4, cg->metrics.w, cg->metrics.h, false);
+		// the statistics of the diff don't hold for the composed image
+		cg->has_alpha_info = false;
+	}
+	dcf_fini(&dcf);
+}
 
-cleanup:
-	free(chunk_map);
-	free(hdr.base_cg_name);
+bool dcf_extract_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr,
+		struct archive *ar)
+{
+	struct dcf dcf;
+	struct cg_metrics m;
+	bool r = dcf_read(data, size, &dcf) && qnt_get_metrics(dcf.cg_data, &m)
+		&& qnt_extract_into(dcf.cg_data, dst, stride, bgr);
+	if (r)
+		dcf_compose(&dcf, ar, dst, stride, m.w, m.h, bgr);
+	dcf_fini(&dcf);
+	return r;
 }
 
 static const uint8_t *dcf_get_qnt(const uint8_t *data)
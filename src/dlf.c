@@ -30,6 +30,8 @@
 static bool dlf_exists(struct archive *ar, int no);
 static struct archive_data *dlf_get(struct archive *ar, int no);
 static bool dlf_load_file(struct archive_data *data);
+static bool dlf_read_range(struct archive *ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread);
+static struct archive_stream *dlf_open_stream(struct archive *ar, int no);
 static void dlf_for_each(struct archive *ar, void (*iter)(struct archive_data *data, void *user), void *user);
 static void dlf_free_data(struct archive_data *data);
 static void dlf_free(struct archive *_ar);
@@ -41,6 +43,8 @@ struct archive_ops dlf_archive_ops = {
 	.get_by_basename = NULL,
 	.load_file = dlf_load_file,
 	.release_file = NULL,
+	.read_range = dlf_read_range,
+	.open_stream = dlf_open_stream,
 	.copy_descriptor = NULL,
 	.for_each = dlf_for_each,
 	.free_data = dlf_free_data,
@@ -68,10 +72,8 @@ static bool dlf_load_file(struct archive_data *data)
 		return true;
 	}
 
-	fseek(ar->f, e->off, SEEK_SET);
-
 	data->data = xmalloc(e->size);
-	if (fread(data->data, e->size, 1, ar->f) != 1) {
+	if (!file_pread(ar->f, data->data, e->size, e->off)) {
 		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
 		free(data->data);
 		data->data = NULL;
@@ -81,6 +83,34 @@ static bool dlf_load_file(struct archive_data *data)
 	return true;
 }
 
+static bool dlf_read_range(struct archive *_ar, int no, size_t off, size_t len, uint8_t *buf, size_t *nread)
+{
+	struct dlf_archive *ar = (struct dlf_archive*)_ar;
+	if ((uint32_t)no >= DLF_NR_ENTRIES || !ar->files[no].off)
+		return false;
+	struct dlf_entry *e = &ar->files[no];
+
+	size_t n = off < e->size ? min(len, e->size - off) : 0;
+	if (ar->ar.mmapped) {
+		memcpy(buf, (uint8_t*)ar->mmap_ptr + e->off + off, n);
+	} else if (n && !file_pread(ar->f, buf, n, e->off + off)) {
+		WARNING("Failed to read '%s': %s", ar->filename, strerror(errno));
+		return false;
+	}
+	*nread = n;
+	return true;
+}
+
+static struct archive_stream *dlf_open_stream(struct archive *_ar, int no)
+{
+	struct dlf_archive *ar = (struct dlf_archive*)_ar;
+	if ((uint32_t)no >= DLF_NR_ENTRIES || !ar->files[no].off)
+		return NULL;
+	struct dlf_entry *e = &ar->files[no];
+	return _archive_open_file_stream(_ar, no, ar->f, ar->ar.mmapped ? ar->mmap_ptr : NULL,
+			e->off, e->size);
+}
+
 static struct archive_data *dlf_get_descriptor(struct archive *_ar, int no)
 {
 	const char *extensions[3] = {".dgn", ".dtx", ".tes"};
@@ -31,6 +31,7 @@
 #ifdef _WIN32
 #include <Windows.h>
 #include <direct.h>
+#include <io.h>
 #else
 #include <libgen.h>
 #endif
@@ -261,6 +262,46 @@ void *file_read(const char *path, size_t *len_out)
 	return buf;
 }
 
+/*
+ * Read `size` bytes at offset `off` of an open file. The stream's file
+ * position is neither used nor modified, so this may be called concurrently
+ * on the same FILE* from multiple threads.
+ */
+bool file_pread(FILE *f, void *buf, size_t size, off_t off)
+{
+	uint8_t *p = buf;
+#ifdef _WIN32
+	HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+	if (h == INVALID_HANDLE_VALUE)
+		return false;
+	while (size > 0) {
+		OVERLAPPED ov = {0};
+		ov.Offset = (DWORD)((uint64_t)off & 0xffffffff);
+		ov.OffsetHigh = (DWORD)((uint64_t)off >> 32);
+		DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+		DWORD nread;
+		if (!ReadFile(h, p, chunk, &nread, &ov) || nread == 0)
+			return false;
+		p += nread;
+		off += nread;
+		size -= nread;
+	}
+#else
+	int fd = fileno(f);
+	while (size > 0) {
+		ssize_t nread = pread(fd, p, size, off);
+		if (nread < 0 && errno == EINTR)
+			continue;
+		if (nread <= 0)
+			return false;
+		p += nread;
+		off += nread;
+		size -= nread;
+	}
+#endif
+	return true;
+}
+
 bool file_write(const char *path, uint8_t *data, size_t data_size)
 {
 	FILE *fp = file_open_utf8(path, "wb");
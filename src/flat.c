@@ -43,11 +43,22 @@ static const char *get_file_extension(int type, const char *data)
 	}
 }
 
+static void flat_free_inflated(struct archive_data *data)
+{
+	struct flat_data *flat = (struct flat_data*)data;
+	if (flat->cached)
+		_archive_cache_release(data->archive, data->no, data->data);
+	else
+		free(data->data);
+	flat->inflated = false;
+	flat->cached = false;
+}
+
 static void flat_free_data(struct archive_data *data)
 {
 	struct flat_data *flat = (struct flat_data*)data;
 	if (flat->inflated)
-		free(data->data);
+		flat_free_inflated(data);
 	free(data->name);
 	free(data);
 }
@@ -117,6 +128,19 @@ static bool flat_load_file(possibly_unused struct archive_data *data)
 
 	// inflate zlib compressed data
 	if (flatdata->type == FLAT_ZLIB && ar->data[flatdata->off+4] == 0x78) {
+		if (flatdata->inflated)
+			return true;
+		if (ar->ar.cache) {
+			size_t cached_size;
+			uint8_t *cached = _archive_cache_get(&ar->ar, data->no, &cached_size);
+			if (cached) {
+				data->data = cached;
+				data->size = cached_size;
+				flatdata->inflated = true;
+				flatdata->cached = true;
+				return true;
+			}
+		}
 		unsigned long size = LittleEndian_getDW(ar->data, flatdata->off);
 		uint8_t *out = xmalloc(size);
 		if (uncompress(out, &size, ar->data + flatdata->off + 4, flatdata->size - 4) != Z_OK) {
@@ -127,6 +151,13 @@ static bool flat_load_file(possibly_unused struct archive_data *data)
 		data->data = out;
 		data->size = size;
 		flatdata->inflated = true;
+		if (ar->ar.cache) {
+			uint8_t *cached = _archive_cache_put(&ar->ar, data->no, out, size);
+			if (cached) {
+				data->data = cached;
+				flatdata->cached = true;
+			}
+		}
 	}
 
 	return true;
@@ -137,10 +168,9 @@ static void flat_release_file(possibly_unused struct archive_data *data)
 	struct flat_archive *ar = (struct flat_archive*)data->archive;
 	struct flat_data *flatdata = (struct flat_data*)data;
 	if (flatdata->inflated) {
-		free(data->data);
+		flat_free_inflated(data);
 		data->data = ar->data + flatdata->off;
 		data->size = flatdata->size;
-		flatdata->inflated = false;
 	}
 }
 
@@ -153,6 +183,7 @@ static struct archive_data *flat_copy_descriptor(struct archive_data *_src)
 	dst->size = src->size;
 	dst->type = src->type;
 	dst->inflated = false;
+	dst->cached = false;
 	return &dst->super;
 }
 
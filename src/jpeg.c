@@ -15,18 +15,22 @@
  */
 
 #include <stdbool.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <turbojpeg.h>
 #include "system4.h"
 #include "system4/cg.h"
 #include "system4/jpeg.h"
+#include "cg_decoder.h"
 
 bool jpeg_cg_checkfmt(const uint8_t *data)
 {
 	return data[0] == 0xff && data[1] == 0xd8;
 }
 
-static bool get_metrics(tjhandle decompressor, const uint8_t *data, size_t size, struct cg_metrics *dst)
+static bool get_metrics(tjhandle decompressor, const uint8_t *data, size_t size, struct cg_metrics *dst,
+		int *subsamp_out)
 {
 	int width, height, subsamp;
 	if (tjDecompressHeader2(decompressor, (unsigned char *)data, size, &width, &height, &subsamp) < 0) {
@@ -40,33 +44,151 @@ static bool get_metrics(tjhandle decompressor, const uint8_t *data, size_t size,
 	dst->has_alpha = false;
 	dst->pixel_pitch = width * 3;
 	dst->alpha_pitch = 1;
+	if (subsamp_out)
+		*subsamp_out = subsamp;
 	return true;
 }
 
 bool jpeg_cg_get_metrics(const uint8_t *data, size_t size, struct cg_metrics *dst)
 {
-	tjhandle decompressor = tjInitDecompress();
-	bool result = get_metrics(decompressor, data, size, dst);
-	tjDestroy(decompressor);
-	return result;
+	tjhandle decompressor = cg_decoder_tj(cg_decoder_ctx_get());
+	return decompressor && get_metrics(decompressor, data, size, dst, NULL);
 }
 
-void jpeg_cg_extract(const uint8_t *data, size_t size, struct cg *cg)
+/*
+ * Get the smallest size that DCT scaling can decode a w*h JPEG at which still
+ * covers its fitted size in a max_w*max_h box (see cg_get_scaled_size).
+ */
+void jpeg_get_decode_size(int w, int h, int max_w, int max_h, int *w_out, int *h_out)
 {
-	tjhandle decompressor = tjInitDecompress();
+	int tw, th, n;
+	cg_get_scaled_size(w, h, max_w, max_h, &tw, &th);
+	*w_out = w;
+	*h_out = h;
+	if (tw == w && th == h)
+		return;
 
-	if (!get_metrics(decompressor, data, size, &cg->metrics))
-		goto cleanup;
+	tjscalingfactor *sf = tjGetScalingFactors(&n);
+	for (int i = 0; sf && i < n; i++) {
+		if (sf[i].num >= sf[i].denom)
+			continue;
+		int sw = TJSCALED(w, sf[i]);
+		int sh = TJSCALED(h, sf[i]);
+		if (sw >= tw && sh >= th && sw <= *w_out && sh <= *h_out) {
+			*w_out = sw;
+			*h_out = sh;
+		}
+	}
+}
 
-	uint8_t *buf = xmalloc(cg->metrics.w * cg->metrics.h * 4);
-	if (tjDecompress2(decompressor, data, size, buf, cg->metrics.w, 0, cg->metrics.h, TJPF_RGBA, 0) < 0) {
+void jpeg_cg_extract_scaled(const uint8_t *data, size_t size, struct cg *cg, int max_w, int max_h)
+{
+	int w, h;
+	tjhandle decompressor = cg_decoder_tj(cg_decoder_ctx_get());
+	if (!decompressor || !get_metrics(decompressor, data, size, &cg->metrics, NULL))
+		return;
+
+	jpeg_get_decode_size(cg->metrics.w, cg->metrics.h, max_w, max_h, &w, &h);
+	uint8_t *buf = xmalloc((size_t)w * h * 4);
+	if (tjDecompress2(decompressor, data, size, buf, w, 0, h, TJPF_RGBA, 0) < 0) {
 		WARNING("JPEG decompression failed: %s", tjGetErrorStr());
 		free(buf);
-		goto cleanup;
+		return;
 	}
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	cg->metrics.pixel_pitch = w * 3;
 	cg->type = ALCG_JPEG;
 	cg->pixels = buf;
+	cg_set_opaque(cg);
+}
+
+void jpeg_cg_extract(const uint8_t *data, size_t size, struct cg *cg)
+{
+	jpeg_cg_extract_scaled(data, size, cg, INT_MAX, INT_MAX);
+}
+
+/*
+ * Extract the region (x, y, w, h) of a JPEG, which must lie within the image.
+ * The JPEG is first cropped losslessly to the MCUs around the region (with one
+ * MCU of context for chroma upsampling, so that the result is the same as a
+ * full decode), and only that part is decompressed.
+ */
+void jpeg_cg_extract_rect(const uint8_t *data, size_t size, struct cg *cg, int x, int y, int w, int h)
+{
+	int subsamp;
+	struct cg_decoder_ctx *ctx = cg_decoder_ctx_get();
+	tjhandle decompressor = cg_decoder_tj(ctx);
+	if (!decompressor || !get_metrics(decompressor, data, size, &cg->metrics, &subsamp))
+		return;
+
+	int mcu_w = tjMCUWidth[subsamp];
+	int mcu_h = tjMCUHeight[subsamp];
+	int x0 = max(x / mcu_w - 1, 0) * mcu_w;
+	int y0 = max(y / mcu_h - 1, 0) * mcu_h;
+	int x1 = min(((x + w - 1) / mcu_w + 2) * mcu_w, cg->metrics.w);
+	int y1 = min(((y + h - 1) / mcu_h + 2) * mcu_h, cg->metrics.h);
+
+	const uint8_t *src = data;
+	unsigned long src_size = size;
+	unsigned char *cropped = NULL;
+	uint8_t *tmp = NULL;
+	if (x0 > 0 || y0 > 0 || x1 < cg->metrics.w || y1 < cg->metrics.h) {
+		tjhandle transformer = cg_decoder_tj_transform(ctx);
+		tjtransform xform = {
+			.r = { .x = x0, .y = y0, .w = x1 - x0, .h = y1 - y0 },
+			.op = TJXOP_NONE,
+			.options = TJXOPT_CROP,
+		};
+		unsigned long cropped_size = 0;
+		if (transformer && tjTransform(transformer, (unsigned char*)data, size, 1,
+					&cropped, &cropped_size, &xform, 0) >= 0) {
+			src = cropped;
+			src_size = cropped_size;
+		} else {
+			// decode the whole image instead
+			WARNING("tjTransform failed: %s", tjGetErrorStr());
+			x0 = y0 = 0;
+			x1 = cg->metrics.w;
+			y1 = cg->metrics.h;
+		}
+	}
+
+	int dw = x1 - x0, dh = y1 - y0;
+	tmp = xmalloc((size_t)dw * dh * 4);
+	if (tjDecompress2(decompressor, src, src_size, tmp, dw, 0, dh, TJPF_RGBA, 0) < 0) {
+		WARNING("JPEG decompression failed: %s", tjGetErrorStr());
+		goto cleanup;
+	}
+
+	uint8_t *pixels = xmalloc((size_t)w * h * 4);
+	for (int row = 0; row < h; row++) {
+		memcpy(pixels + (size_t)row * w * 4, tmp + ((size_t)(y - y0 + row) * dw + (x - x0)) * 4, w * 4);
+	}
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	cg->metrics.pixel_pitch = w * 3;
+	cg->type = ALCG_JPEG;
+	cg->pixels = pixels;
+	cg_set_opaque(cg);
 
 cleanup:
-	tjDestroy(decompressor);
+	free(tmp);
+	if (cropped)
+		tjFree(cropped);
+}
+
+bool jpeg_cg_extract_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr)
+{
+	struct cg_metrics metrics;
+	tjhandle decompressor = cg_decoder_tj(cg_decoder_ctx_get());
+	if (!decompressor || !get_metrics(decompressor, data, size, &metrics, NULL))
+		return false;
+
+	if (tjDecompress2(decompressor, data, size, dst, metrics.w, stride, metrics.h,
+				bgr ? TJPF_BGRA : TJPF_RGBA, 0) < 0) {
+		WARNING("JPEG decompression failed: %s", tjGetErrorStr());
+		return false;
+	}
+	return true;
 }
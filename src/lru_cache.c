@@ -0,0 +1,180 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "system4.h"
+#include "system4/hashtable.h"
+
+#include "lru_cache.h"
+
+struct lru_entry {
+	int key;
+	int refs;
+	void *value;
+	size_t size;
+	void (*free_value)(void *value);
+	struct lru_entry *prev;
+	struct lru_entry *next;
+};
+
+void lru_cache_init(struct lru_cache *cache, size_t budget, size_t index_size,
+		void (*free_value)(void *value))
+{
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->index = ht_create(index_size);
+	cache->head = NULL;
+	cache->tail = NULL;
+	cache->stats = (struct lru_cache_stats) { .budget = budget };
+	cache->free_value = free_value;
+}
+
+static void free_entry(void *_e)
+{
+	struct lru_entry *e = _e;
+	if (!e)
+		return;
+	e->free_value(e->value);
+	free(e);
+}
+
+void lru_cache_fini(struct lru_cache *cache)
+{
+	ht_foreach_value(cache->index, free_entry);
+	ht_free_int(cache->index);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+static void lru_unlink(struct lru_cache *cache, struct lru_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void lru_push(struct lru_cache *cache, struct lru_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	else
+		cache->tail = e;
+	cache->head = e;
+}
+
+/* Evict unreferenced entries until the cache is within budget. */
+static void lru_evict(struct lru_cache *cache)
+{
+	while (cache->stats.bytes > cache->stats.budget && cache->tail) {
+		struct lru_entry *e = cache->tail;
+		lru_unlink(cache, e);
+		ht_put_int(cache->index, e->key, NULL)->value = NULL;
+		cache->stats.bytes -= e->size;
+		cache->stats.nr_entries--;
+		cache->stats.evictions++;
+		free_entry(e);
+	}
+}
+
+void lru_cache_set_budget(struct lru_cache *cache, size_t budget)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->stats.budget = budget;
+	lru_evict(cache);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void lru_cache_get_stats(struct lru_cache *cache, struct lru_cache_stats *out)
+{
+	pthread_mutex_lock(&cache->lock);
+	*out = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void *lru_cache_get(struct lru_cache *cache, int key, size_t *size_out)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct lru_entry *e = ht_get_int(cache->index, key, NULL);
+	if (!e) {
+		cache->stats.misses++;
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+	if (!e->refs++)
+		lru_unlink(cache, e);
+	cache->stats.hits++;
+	pthread_mutex_unlock(&cache->lock);
+	if (size_out)
+		*size_out = e->size;
+	return e->value;
+}
+
+void *lru_cache_put(struct lru_cache *cache, int key, void *value, size_t size)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (size > cache->stats.budget) {
+		pthread_mutex_unlock(&cache->lock);
+		return NULL;
+	}
+
+	struct ht_slot *slot = ht_put_int(cache->index, key, NULL);
+	struct lru_entry *e = slot->value;
+	if (e) {
+		// another thread got there first
+		if (!e->refs++)
+			lru_unlink(cache, e);
+		pthread_mutex_unlock(&cache->lock);
+		cache->free_value(value);
+		return e->value;
+	}
+
+	e = xcalloc(1, sizeof(struct lru_entry));
+	e->key = key;
+	e->refs = 1;
+	e->value = value;
+	e->size = size;
+	e->free_value = cache->free_value;
+	slot->value = e;
+	cache->stats.bytes += size;
+	cache->stats.nr_entries++;
+	lru_evict(cache);
+	pthread_mutex_unlock(&cache->lock);
+	return value;
+}
+
+bool lru_cache_release(struct lru_cache *cache, int key, const void *value)
+{
+	pthread_mutex_lock(&cache->lock);
+	struct lru_entry *e = ht_get_int(cache->index, key, NULL);
+	if (!e || e->value != value) {
+		pthread_mutex_unlock(&cache->lock);
+		return false;
+	}
+	if (!--e->refs) {
+		lru_push(cache, e);
+		lru_evict(cache);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return true;
+}
@@ -0,0 +1,81 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+struct hash_table;
+struct lru_entry;
+
+struct lru_cache_stats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	size_t nr_entries;
+	size_t bytes;
+	size_t budget;
+};
+
+/*
+ * A reference-counted cache of values keyed by integers, holding up to a byte
+ * budget of values that are not in use. Values are opaque to the cache, which
+ * frees them with `free_value` when they are evicted. Referenced values are
+ * never evicted; unreferenced ones are evicted in least-recently-used order.
+ *
+ * All functions except lru_cache_init and lru_cache_fini may be called
+ * concurrently.
+ */
+struct lru_cache {
+	pthread_mutex_t lock;
+	struct hash_table *index;  // key -> lru_entry
+	// unreferenced entries, most recently used first
+	struct lru_entry *head;
+	struct lru_entry *tail;
+	struct lru_cache_stats stats;
+	void (*free_value)(void *value);
+};
+
+void lru_cache_init(struct lru_cache *cache, size_t budget, size_t index_size,
+		void (*free_value)(void *value));
+void lru_cache_fini(struct lru_cache *cache);
+// change the budget, evicting entries as needed
+void lru_cache_set_budget(struct lru_cache *cache, size_t budget);
+void lru_cache_get_stats(struct lru_cache *cache, struct lru_cache_stats *out);
+
+/*
+ * Look up and reference the value for `key`. Returns NULL on a miss.
+ */
+void *lru_cache_get(struct lru_cache *cache, int key, size_t *size_out);
+
+/*
+ * Insert a referenced value of `size` bytes for `key`, taking ownership of it.
+ * If another value was inserted for `key` first, `value` is freed and the
+ * existing value is referenced and returned instead. Returns NULL (leaving
+ * `value` owned by the caller) if `size` exceeds the budget.
+ */
+void *lru_cache_put(struct lru_cache *cache, int key, void *value, size_t size);
+
+/*
+ * Drop a reference obtained from lru_cache_get or lru_cache_put. Returns false
+ * if `value` is not the cached value for `key`.
+ */
+bool lru_cache_release(struct lru_cache *cache, int key, const void *value);
+
+#endif /* LRU_CACHE_H */
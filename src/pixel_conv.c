@@ -0,0 +1,808 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "system4.h"
+#include "pixel_conv.h"
+
+/*
+ * Scalar kernels
+ *
+ * The SIMD kernels below handle as many whole vectors as they can and leave
+ * the remaining pixels to these.
+ */
+
+static void rgb_to_rgba(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (size_t i = 0; i < n; i++, dst += 4, src += 3) {
+		dst[0] = src[0];
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst[3] = 0xff;
+	}
+}
+
+static void rgb565_to_rgba(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n)
+{
+	for (size_t i = 0; i < n; i++, dst += 4) {
+		unsigned r = src[i] & 0xf800;
+		unsigned g = src[i] & 0x07e0;
+		unsigned b = src[i] & 0x001f;
+		dst[0] = r >> 8 | r >> 13;
+		dst[1] = g >> 3 | g >> 9;
+		dst[2] = b << 3 | b >> 2;
+		dst[3] = alpha ? alpha[i] : 0xff;
+	}
+}
+
+static void alpha_to_rgba(uint8_t *dst, const uint8_t *alpha, size_t n)
+{
+	for (size_t i = 0; i < n; i++, dst += 4) {
+		dst[0] = 0;
+		dst[1] = 0;
+		dst[2] = 0;
+		dst[3] = alpha[i];
+	}
+}
+
+static void set_alpha(uint8_t *rgba, const uint8_t *alpha, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		rgba[i*4 + 3] = alpha[i];
+}
+
+static void swap_rb(uint8_t *rgba, size_t n)
+{
+	for (size_t i = 0; i < n; i++, rgba += 4) {
+		uint8_t r = rgba[0];
+		rgba[0] = rgba[2];
+		rgba[2] = r;
+	}
+}
+
+static void premultiply(uint8_t *rgba, size_t n)
+{
+	for (size_t i = 0; i < n; i++, rgba += 4) {
+		unsigned a = rgba[3];
+		for (int c = 0; c < 3; c++) {
+			// round(rgba[c] * a / 255)
+			unsigned t = rgba[c] * a + 128;
+			rgba[c] = (t + (t >> 8)) >> 8;
+		}
+	}
+}
+
+// alpha statistics of a run of pixels
+struct alpha_scan {
+	uint8_t min;
+	uint8_t max;
+	bool partial;
+	ptrdiff_t first; // first non-zero alpha, or -1
+	ptrdiff_t last;  // last non-zero alpha, or -1
+};
+
+static void alpha_scan_init(struct alpha_scan *s)
+{
+	s->min = 0xff;
+	s->max = 0;
+	s->partial = false;
+	s->first = s->last = -1;
+}
+
+// scan alpha values [i, n), `pitch` bytes apart
+static void scan_alpha_from(const uint8_t *alpha, size_t pitch, size_t i, size_t n, struct alpha_scan *s)
+{
+	for (; i < n; i++) {
+		uint8_t a = alpha[i * pitch];
+		s->min = min(s->min, a);
+		s->max = max(s->max, a);
+		if (!a)
+			continue;
+		if (a != 0xff)
+			s->partial = true;
+		if (s->first < 0)
+			s->first = i;
+		s->last = i;
+	}
+}
+
+static void scan_alpha(const uint8_t *alpha, size_t n, struct alpha_scan *s)
+{
+	alpha_scan_init(s);
+	scan_alpha_from(alpha, 1, 0, n, s);
+}
+
+static void scan_rgba_alpha(const uint8_t *rgba, size_t n, struct alpha_scan *s)
+{
+	alpha_scan_init(s);
+	scan_alpha_from(rgba + 3, 4, 0, n, s);
+}
+
+struct pixel_kernels {
+	void (*rgb_to_rgba)(uint8_t *dst, const uint8_t *src, size_t n);
+	void (*rgb565_to_rgba)(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n);
+	void (*alpha_to_rgba)(uint8_t *dst, const uint8_t *alpha, size_t n);
+	void (*set_alpha)(uint8_t *rgba, const uint8_t *alpha, size_t n);
+	void (*swap_rb)(uint8_t *rgba, size_t n);
+	void (*premultiply)(uint8_t *rgba, size_t n);
+	void (*scan_alpha)(const uint8_t *alpha, size_t n, struct alpha_scan *s);
+	void (*scan_rgba_alpha)(const uint8_t *rgba, size_t n, struct alpha_scan *s);
+};
+
+possibly_unused static const struct pixel_kernels pixel_kernels_scalar = {
+	.rgb_to_rgba = rgb_to_rgba,
+	.rgb565_to_rgba = rgb565_to_rgba,
+	.alpha_to_rgba = alpha_to_rgba,
+	.set_alpha = set_alpha,
+	.swap_rb = swap_rb,
+	.premultiply = premultiply,
+	.scan_alpha = scan_alpha,
+	.scan_rgba_alpha = scan_rgba_alpha,
+};
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/*
+ * SSE2 has no byte shuffle, so 24-bit pixels are widened with (unaligned)
+ * 32-bit loads instead; the last pixel is done separately so that nothing is
+ * read past the end of the source.
+ */
+static void rgb_to_rgba_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 1 < n; i++) {
+		uint32_t v;
+		memcpy(&v, src + i*3, 4);
+		v |= 0xff000000;
+		memcpy(dst + i*4, &v, 4);
+	}
+	rgb_to_rgba(dst + i*4, src + i*3, n - i);
+}
+
+/*
+ * Expand 8 RGB565 pixels and their alpha (in the high bytes of 16-bit lanes)
+ * to RGBA.
+ */
+static inline void rgb565_store_sse2(uint8_t *dst, __m128i v, __m128i a)
+{
+	const __m128i r = _mm_and_si128(v, _mm_set1_epi16((short)0xf800));
+	const __m128i g = _mm_and_si128(v, _mm_set1_epi16(0x07e0));
+	const __m128i b = _mm_and_si128(v, _mm_set1_epi16(0x001f));
+	const __m128i r8 = _mm_or_si128(_mm_srli_epi16(r, 8), _mm_srli_epi16(r, 13));
+	const __m128i g8 = _mm_or_si128(_mm_slli_epi16(g, 5), _mm_srli_epi16(g, 1));
+	const __m128i b8 = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+	// (r8 | g8 << 8) and (b8 | a << 8) are the two halves of each pixel
+	const __m128i rg = _mm_or_si128(r8, _mm_and_si128(g8, _mm_set1_epi16((short)0xff00)));
+	const __m128i ba = _mm_or_si128(b8, a);
+	_mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi16(rg, ba));
+	_mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi16(rg, ba));
+}
+
+static void rgb565_to_rgba_sse2(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	const __m128i opaque = _mm_set1_epi16((short)0xff00);
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128i a = opaque;
+		if (alpha)
+			a = _mm_unpacklo_epi8(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i*)(alpha + i)));
+		rgb565_store_sse2(dst + i*4, v, a);
+	}
+	rgb565_to_rgba(dst + i*4, src + i, alpha ? alpha + i : NULL, n - i);
+}
+
+static void alpha_to_rgba_sse2(uint8_t *dst, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(alpha + i));
+		__m128i lo = _mm_unpacklo_epi8(zero, a);
+		__m128i hi = _mm_unpackhi_epi8(zero, a);
+		_mm_storeu_si128((__m128i*)(dst + i*4), _mm_unpacklo_epi16(zero, lo));
+		_mm_storeu_si128((__m128i*)(dst + i*4 + 16), _mm_unpackhi_epi16(zero, lo));
+		_mm_storeu_si128((__m128i*)(dst + i*4 + 32), _mm_unpacklo_epi16(zero, hi));
+		_mm_storeu_si128((__m128i*)(dst + i*4 + 48), _mm_unpackhi_epi16(zero, hi));
+	}
+	alpha_to_rgba(dst + i*4, alpha + i, n - i);
+}
+
+static void set_alpha_sse2(uint8_t *rgba, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(alpha + i));
+		__m128i lo = _mm_unpacklo_epi8(zero, a);
+		__m128i hi = _mm_unpackhi_epi8(zero, a);
+		__m128i a32[4] = {
+			_mm_unpacklo_epi16(zero, lo), _mm_unpackhi_epi16(zero, lo),
+			_mm_unpacklo_epi16(zero, hi), _mm_unpackhi_epi16(zero, hi),
+		};
+		for (int j = 0; j < 4; j++) {
+			__m128i *p = (__m128i*)(rgba + i*4 + j*16);
+			_mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(p), rgb), a32[j]));
+		}
+	}
+	set_alpha(rgba + i*4, alpha + i, n - i);
+}
+
+static inline __m128i swap_rb_sse2_4(__m128i v)
+{
+	const __m128i ga = _mm_and_si128(v, _mm_set1_epi32(0xff00ff00));
+	const __m128i rb = _mm_and_si128(v, _mm_set1_epi32(0x00ff00ff));
+	// rotating each 32-bit lane by 16 bits swaps R and B
+	return _mm_or_si128(ga, _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16)));
+}
+
+static void swap_rb_sse2(uint8_t *rgba, size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i *p = (__m128i*)(rgba + i*4);
+		_mm_storeu_si128(p, swap_rb_sse2_4(_mm_loadu_si128(p)));
+	}
+	swap_rb(rgba + i*4, n - i);
+}
+
+/*
+ * Premultiply 2 pixels widened to 16-bit lanes. The alpha lanes are kept
+ * as-is.
+ */
+static inline __m128i premultiply_sse2_2(__m128i v)
+{
+	const __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xff), 0xff);
+	const __m128i alpha_mask = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(v, a), _mm_set1_epi16(128));
+	t = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+	return _mm_or_si128(_mm_andnot_si128(alpha_mask, t), _mm_and_si128(alpha_mask, v));
+}
+
+static void premultiply_sse2(uint8_t *rgba, size_t n)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 4 <= n; i += 4) {
+		__m128i *p = (__m128i*)(rgba + i*4);
+		__m128i v = _mm_loadu_si128(p);
+		__m128i lo = premultiply_sse2_2(_mm_unpacklo_epi8(v, zero));
+		__m128i hi = premultiply_sse2_2(_mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+	}
+	premultiply(rgba + i*4, n - i);
+}
+
+/*
+ * Reduce the per-byte minimum, maximum and maximum of (alpha + 1) of a scan.
+ * Since 0 and 255 wrap around to 1 and 0, a partial alpha shows up as an
+ * (alpha + 1) of 2 or more.
+ */
+static void alpha_scan_reduce_sse2(struct alpha_scan *s, __m128i vmin, __m128i vmax, __m128i vpart)
+{
+	uint8_t b_min[16], b_max[16], b_part[16];
+	_mm_storeu_si128((__m128i*)b_min, vmin);
+	_mm_storeu_si128((__m128i*)b_max, vmax);
+	_mm_storeu_si128((__m128i*)b_part, vpart);
+	for (int i = 0; i < 16; i++) {
+		s->min = min(s->min, b_min[i]);
+		s->max = max(s->max, b_max[i]);
+		if (b_part[i] >= 2)
+			s->partial = true;
+	}
+}
+
+// record the first and last bits of a non-zero mask of vector `i` (in pixels)
+static inline void alpha_scan_bounds(struct alpha_scan *s, size_t i, unsigned nz)
+{
+	if (s->first < 0)
+		s->first = i + __builtin_ctz(nz);
+	s->last = i + (31 - __builtin_clz(nz));
+}
+
+static void scan_alpha_sse2(const uint8_t *alpha, size_t n, struct alpha_scan *s)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i vmin = _mm_set1_epi8(-1), vmax = zero, vpart = zero;
+	alpha_scan_init(s);
+	for (; i + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(alpha + i));
+		vmin = _mm_min_epu8(vmin, a);
+		vmax = _mm_max_epu8(vmax, a);
+		vpart = _mm_max_epu8(vpart, _mm_add_epi8(a, one));
+		unsigned nz = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) & 0xffff;
+		if (nz)
+			alpha_scan_bounds(s, i, nz);
+	}
+	alpha_scan_reduce_sse2(s, vmin, vmax, vpart);
+	scan_alpha_from(alpha, 1, i, n, s);
+}
+
+static void scan_rgba_alpha_sse2(const uint8_t *rgba, size_t n, struct alpha_scan *s)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+	__m128i vmin = _mm_set1_epi8(-1), vmax = zero, vpart = zero;
+	alpha_scan_init(s);
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(rgba + i*4));
+		// colour bytes count as 255 for the minimum and as 0 otherwise
+		__m128i a = _mm_andnot_si128(rgb, v);
+		vmin = _mm_min_epu8(vmin, _mm_or_si128(v, rgb));
+		vmax = _mm_max_epu8(vmax, a);
+		vpart = _mm_max_epu8(vpart, _mm_add_epi8(a, one));
+		unsigned nz = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, zero))) & 0xf;
+		if (nz)
+			alpha_scan_bounds(s, i, nz);
+	}
+	alpha_scan_reduce_sse2(s, vmin, vmax, vpart);
+	scan_alpha_from(rgba + 3, 4, i, n, s);
+}
+
+static const struct pixel_kernels pixel_kernels_sse2 = {
+	.rgb_to_rgba = rgb_to_rgba_sse2,
+	.rgb565_to_rgba = rgb565_to_rgba_sse2,
+	.alpha_to_rgba = alpha_to_rgba_sse2,
+	.set_alpha = set_alpha_sse2,
+	.swap_rb = swap_rb_sse2,
+	.premultiply = premultiply_sse2,
+	.scan_alpha = scan_alpha_sse2,
+	.scan_rgba_alpha = scan_rgba_alpha_sse2,
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_PIXEL_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void rgb_to_rgba_avx2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	const __m256i shuf = _mm256_setr_epi8(
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+			0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m256i opaque = _mm256_set1_epi32(0xff000000);
+	// each 16-byte load covers 4 pixels and reads 4 bytes past them
+	for (; i + 8 + 2 <= n; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i*)(src + i*3));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(src + i*3 + 12));
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), opaque);
+		_mm256_storeu_si256((__m256i*)(dst + i*4), v);
+	}
+	rgb_to_rgba_sse2(dst + i*4, src + i*3, n - i);
+}
+
+__attribute__((target("avx2")))
+static void rgb565_to_rgba_avx2(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	const __m256i opaque = _mm256_set1_epi16((short)0xff00);
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256i a = opaque;
+		if (alpha)
+			a = _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(alpha + i))), 8);
+		const __m256i r = _mm256_and_si256(v, _mm256_set1_epi16((short)0xf800));
+		const __m256i g = _mm256_and_si256(v, _mm256_set1_epi16(0x07e0));
+		const __m256i b = _mm256_and_si256(v, _mm256_set1_epi16(0x001f));
+		const __m256i r8 = _mm256_or_si256(_mm256_srli_epi16(r, 8), _mm256_srli_epi16(r, 13));
+		const __m256i g8 = _mm256_or_si256(_mm256_slli_epi16(g, 5), _mm256_srli_epi16(g, 1));
+		const __m256i b8 = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+		const __m256i rg = _mm256_or_si256(r8, _mm256_and_si256(g8, _mm256_set1_epi16((short)0xff00)));
+		const __m256i ba = _mm256_or_si256(b8, a);
+		// the unpacks work within 128-bit lanes: pixels 0-3 and 8-11, 4-7 and 12-15
+		const __m256i p0 = _mm256_unpacklo_epi16(rg, ba);
+		const __m256i p1 = _mm256_unpackhi_epi16(rg, ba);
+		_mm256_storeu_si256((__m256i*)(dst + i*4), _mm256_permute2x128_si256(p0, p1, 0x20));
+		_mm256_storeu_si256((__m256i*)(dst + i*4 + 32), _mm256_permute2x128_si256(p0, p1, 0x31));
+	}
+	rgb565_to_rgba_sse2(dst + i*4, src + i, alpha ? alpha + i : NULL, n - i);
+}
+
+__attribute__((target("avx2")))
+static void alpha_to_rgba_avx2(uint8_t *dst, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(alpha + i)));
+		_mm256_storeu_si256((__m256i*)(dst + i*4), _mm256_slli_epi32(a, 24));
+	}
+	alpha_to_rgba(dst + i*4, alpha + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void set_alpha_avx2(uint8_t *rgba, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	for (; i + 8 <= n; i += 8) {
+		__m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(alpha + i)));
+		__m256i *p = (__m256i*)(rgba + i*4);
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256(p), rgb);
+		_mm256_storeu_si256(p, _mm256_or_si256(v, _mm256_slli_epi32(a, 24)));
+	}
+	set_alpha(rgba + i*4, alpha + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_rb_avx2(uint8_t *rgba, size_t n)
+{
+	size_t i = 0;
+	const __m256i shuf = _mm256_setr_epi8(
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+			2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	for (; i + 8 <= n; i += 8) {
+		__m256i *p = (__m256i*)(rgba + i*4);
+		_mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuf));
+	}
+	swap_rb(rgba + i*4, n - i);
+}
+
+__attribute__((target("avx2")))
+static void premultiply_avx2(uint8_t *rgba, size_t n)
+{
+	size_t i = 0;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i round = _mm256_set1_epi16(128);
+	const __m256i alpha_mask = _mm256_set1_epi64x((long long)0xffff000000000000ull);
+	const __m256i shuf_a = _mm256_setr_epi8(
+			6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+			6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+	for (; i + 8 <= n; i += 8) {
+		__m256i *p = (__m256i*)(rgba + i*4);
+		__m256i v = _mm256_loadu_si256(p);
+		__m256i w[2] = { _mm256_unpacklo_epi8(v, zero), _mm256_unpackhi_epi8(v, zero) };
+		for (int j = 0; j < 2; j++) {
+			__m256i a = _mm256_shuffle_epi8(w[j], shuf_a);
+			__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(w[j], a), round);
+			t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+			w[j] = _mm256_blendv_epi8(t, w[j], alpha_mask);
+		}
+		// the unpacks and the pack both work within 128-bit lanes
+		_mm256_storeu_si256(p, _mm256_packus_epi16(w[0], w[1]));
+	}
+	premultiply_sse2(rgba + i*4, n - i);
+}
+
+__attribute__((target("avx2")))
+static void alpha_scan_reduce_avx2(struct alpha_scan *s, __m256i vmin, __m256i vmax, __m256i vpart)
+{
+	alpha_scan_reduce_sse2(s,
+			_mm_min_epu8(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1)),
+			_mm_max_epu8(_mm256_castsi256_si128(vmax), _mm256_extracti128_si256(vmax, 1)),
+			_mm_max_epu8(_mm256_castsi256_si128(vpart), _mm256_extracti128_si256(vpart, 1)));
+}
+
+__attribute__((target("avx2")))
+static void scan_alpha_avx2(const uint8_t *alpha, size_t n, struct alpha_scan *s)
+{
+	size_t i = 0;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	__m256i vmin = _mm256_set1_epi8(-1), vmax = zero, vpart = zero;
+	alpha_scan_init(s);
+	for (; i + 32 <= n; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(alpha + i));
+		vmin = _mm256_min_epu8(vmin, a);
+		vmax = _mm256_max_epu8(vmax, a);
+		vpart = _mm256_max_epu8(vpart, _mm256_add_epi8(a, one));
+		unsigned nz = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero));
+		if (nz)
+			alpha_scan_bounds(s, i, nz);
+	}
+	alpha_scan_reduce_avx2(s, vmin, vmax, vpart);
+	scan_alpha_from(alpha, 1, i, n, s);
+}
+
+__attribute__((target("avx2")))
+static void scan_rgba_alpha_avx2(const uint8_t *rgba, size_t n, struct alpha_scan *s)
+{
+	size_t i = 0;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi8(1);
+	const __m256i rgb = _mm256_set1_epi32(0x00ffffff);
+	__m256i vmin = _mm256_set1_epi8(-1), vmax = zero, vpart = zero;
+	alpha_scan_init(s);
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(rgba + i*4));
+		__m256i a = _mm256_andnot_si256(rgb, v);
+		vmin = _mm256_min_epu8(vmin, _mm256_or_si256(v, rgb));
+		vmax = _mm256_max_epu8(vmax, a);
+		vpart = _mm256_max_epu8(vpart, _mm256_add_epi8(a, one));
+		unsigned nz = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, zero))) & 0xff;
+		if (nz)
+			alpha_scan_bounds(s, i, nz);
+	}
+	alpha_scan_reduce_avx2(s, vmin, vmax, vpart);
+	scan_alpha_from(rgba + 3, 4, i, n, s);
+}
+
+static const struct pixel_kernels pixel_kernels_avx2 = {
+	.rgb_to_rgba = rgb_to_rgba_avx2,
+	.rgb565_to_rgba = rgb565_to_rgba_avx2,
+	.alpha_to_rgba = alpha_to_rgba_avx2,
+	.set_alpha = set_alpha_avx2,
+	.swap_rb = swap_rb_avx2,
+	.premultiply = premultiply_avx2,
+	.scan_alpha = scan_alpha_avx2,
+	.scan_rgba_alpha = scan_rgba_alpha_avx2,
+};
+#endif // __GNUC__ && (__x86_64__ || __i386__)
+#endif // __SSE2__
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static void rgb_to_rgba_neon(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x3_t v = vld3q_u8(src + i*3);
+		uint8x16x4_t o = {{ v.val[0], v.val[1], v.val[2], vdupq_n_u8(0xff) }};
+		vst4q_u8(dst + i*4, o);
+	}
+	rgb_to_rgba(dst + i*4, src + i*3, n - i);
+}
+
+static void rgb565_to_rgba_neon(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint16x8_t v = vld1q_u16(src + i);
+		uint8x8_t r = vshrn_n_u16(v, 8);  // RRRRRGGG
+		uint8x8_t g = vshrn_n_u16(v, 3);  // GGGGGGBB
+		uint8x8_t b = vshl_n_u8(vmovn_u16(v), 3);  // BBBBB000
+		uint8x8x4_t o;
+		o.val[0] = vorr_u8(vand_u8(r, vdup_n_u8(0xf8)), vshr_n_u8(r, 5));
+		o.val[1] = vorr_u8(vand_u8(g, vdup_n_u8(0xfc)), vshr_n_u8(g, 6));
+		o.val[2] = vorr_u8(b, vshr_n_u8(b, 5));
+		o.val[3] = alpha ? vld1_u8(alpha + i) : vdup_n_u8(0xff);
+		vst4_u8(dst + i*4, o);
+	}
+	rgb565_to_rgba(dst + i*4, src + i, alpha ? alpha + i : NULL, n - i);
+}
+
+static void alpha_to_rgba_neon(uint8_t *dst, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	const uint8x16_t zero = vdupq_n_u8(0);
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t o = {{ zero, zero, zero, vld1q_u8(alpha + i) }};
+		vst4q_u8(dst + i*4, o);
+	}
+	alpha_to_rgba(dst + i*4, alpha + i, n - i);
+}
+
+static void set_alpha_neon(uint8_t *rgba, const uint8_t *alpha, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(rgba + i*4);
+		v.val[3] = vld1q_u8(alpha + i);
+		vst4q_u8(rgba + i*4, v);
+	}
+	set_alpha(rgba + i*4, alpha + i, n - i);
+}
+
+static void swap_rb_neon(uint8_t *rgba, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(rgba + i*4);
+		uint8x16_t r = v.val[0];
+		v.val[0] = v.val[2];
+		v.val[2] = r;
+		vst4q_u8(rgba + i*4, v);
+	}
+	swap_rb(rgba + i*4, n - i);
+}
+
+static inline uint8x8_t premultiply_neon_8(uint8x8_t c, uint8x8_t a)
+{
+	uint16x8_t t = vaddq_u16(vmull_u8(c, a), vdupq_n_u16(128));
+	// (t + (t >> 8)) >> 8
+	return vaddhn_u16(t, vshrq_n_u16(t, 8));
+}
+
+static void premultiply_neon(uint8_t *rgba, size_t n)
+{
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		uint8x16x4_t v = vld4q_u8(rgba + i*4);
+		uint8x8_t a_lo = vget_low_u8(v.val[3]);
+		uint8x8_t a_hi = vget_high_u8(v.val[3]);
+		for (int c = 0; c < 3; c++) {
+			v.val[c] = vcombine_u8(premultiply_neon_8(vget_low_u8(v.val[c]), a_lo),
+					premultiply_neon_8(vget_high_u8(v.val[c]), a_hi));
+		}
+		vst4q_u8(rgba + i*4, v);
+	}
+	premultiply(rgba + i*4, n - i);
+}
+
+/*
+ * NEON has no movemask, so only the minimum, maximum and (alpha + 1) maximum
+ * (see alpha_scan_reduce_sse2) are vectorized; the bounds are found by
+ * scanning in from either end afterwards.
+ */
+static void alpha_scan_neon_16(uint8x16_t a, uint8x16_t *vmin, uint8x16_t *vmax, uint8x16_t *vpart)
+{
+	*vmin = vminq_u8(*vmin, a);
+	*vmax = vmaxq_u8(*vmax, a);
+	*vpart = vmaxq_u8(*vpart, vaddq_u8(a, vdupq_n_u8(1)));
+}
+
+static void alpha_scan_finish_neon(const uint8_t *alpha, size_t pitch, size_t i, size_t n,
+		struct alpha_scan *s, uint8x16_t vmin, uint8x16_t vmax, uint8x16_t vpart)
+{
+	uint8_t b_min[16], b_max[16], b_part[16];
+	vst1q_u8(b_min, vmin);
+	vst1q_u8(b_max, vmax);
+	vst1q_u8(b_part, vpart);
+	for (int j = 0; j < 16; j++) {
+		s->min = min(s->min, b_min[j]);
+		s->max = max(s->max, b_max[j]);
+		if (b_part[j] >= 2)
+			s->partial = true;
+	}
+	scan_alpha_from(alpha, pitch, i, n, s);
+	if (!s->max || !i)
+		return;
+	size_t first = 0, last = i - 1;
+	while (!alpha[first * pitch])
+		first++;
+	if (s->first < 0 || (ptrdiff_t)first < s->first)
+		s->first = first;
+	if (s->last < 0) {
+		while (!alpha[last * pitch])
+			last--;
+		s->last = last;
+	}
+}
+
+static void scan_alpha_neon(const uint8_t *alpha, size_t n, struct alpha_scan *s)
+{
+	size_t i = 0;
+	uint8x16_t vmin = vdupq_n_u8(0xff), vmax = vdupq_n_u8(0), vpart = vdupq_n_u8(0);
+	alpha_scan_init(s);
+	for (; i + 16 <= n; i += 16)
+		alpha_scan_neon_16(vld1q_u8(alpha + i), &vmin, &vmax, &vpart);
+	alpha_scan_finish_neon(alpha, 1, i, n, s, vmin, vmax, vpart);
+}
+
+static void scan_rgba_alpha_neon(const uint8_t *rgba, size_t n, struct alpha_scan *s)
+{
+	size_t i = 0;
+	uint8x16_t vmin = vdupq_n_u8(0xff), vmax = vdupq_n_u8(0), vpart = vdupq_n_u8(0);
+	alpha_scan_init(s);
+	for (; i + 16 <= n; i += 16)
+		alpha_scan_neon_16(vld4q_u8(rgba + i*4).val[3], &vmin, &vmax, &vpart);
+	alpha_scan_finish_neon(rgba + 3, 4, i, n, s, vmin, vmax, vpart);
+}
+
+possibly_unused static const struct pixel_kernels pixel_kernels_neon = {
+	.rgb_to_rgba = rgb_to_rgba_neon,
+	.rgb565_to_rgba = rgb565_to_rgba_neon,
+	.alpha_to_rgba = alpha_to_rgba_neon,
+	.set_alpha = set_alpha_neon,
+	.swap_rb = swap_rb_neon,
+	.premultiply = premultiply_neon,
+	.scan_alpha = scan_alpha_neon,
+	.scan_rgba_alpha = scan_rgba_alpha_neon,
+};
+#endif // __ARM_NEON
+
+static const struct pixel_kernels *pixel_get_kernels(void)
+{
+#ifdef HAVE_PIXEL_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return &pixel_kernels_avx2;
+#endif
+#if defined(__SSE2__)
+	return &pixel_kernels_sse2;
+#elif defined(__ARM_NEON)
+	return &pixel_kernels_neon;
+#else
+	return &pixel_kernels_scalar;
+#endif
+}
+
+void pixel_rgb_to_rgba(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	pixel_get_kernels()->rgb_to_rgba(dst, src, n);
+}
+
+void pixel_rgb565_to_rgba(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n)
+{
+	pixel_get_kernels()->rgb565_to_rgba(dst, src, alpha, n);
+}
+
+void pixel_alpha_to_rgba(uint8_t *dst, const uint8_t *alpha, size_t n)
+{
+	pixel_get_kernels()->alpha_to_rgba(dst, alpha, n);
+}
+
+void pixel_set_alpha(uint8_t *rgba, const uint8_t *alpha, size_t n)
+{
+	pixel_get_kernels()->set_alpha(rgba, alpha, n);
+}
+
+void pixel_swap_rb(uint8_t *rgba, size_t n)
+{
+	pixel_get_kernels()->swap_rb(rgba, n);
+}
+
+void pixel_premultiply(uint8_t *rgba, size_t n)
+{
+	pixel_get_kernels()->premultiply(rgba, n);
+}
+
+void pixel_alpha_stats_init(struct pixel_alpha_stats *s, int w)
+{
+	s->w = w;
+	s->pos = 0;
+	s->min = 0xff;
+	s->max = 0;
+	s->partial = false;
+	s->x0 = s->y0 = s->x1 = s->y1 = 0;
+}
+
+void pixel_alpha_stats_add(struct pixel_alpha_stats *s, const uint8_t *alpha, size_t pitch, size_t n)
+{
+	const struct pixel_kernels *k = pixel_get_kernels();
+	while (n && s->w > 0) {
+		// split the run at row boundaries
+		int x = s->pos % s->w;
+		int y = s->pos / s->w;
+		size_t m = min(n, (size_t)(s->w - x));
+		struct alpha_scan r;
+		if (pitch == 1) {
+			k->scan_alpha(alpha, m, &r);
+		} else if (pitch == 4) {
+			k->scan_rgba_alpha(alpha - 3, m, &r);
+		} else {
+			alpha_scan_init(&r);
+			scan_alpha_from(alpha, pitch, 0, m, &r);
+		}
+
+		s->min = min(s->min, r.min);
+		s->max = max(s->max, r.max);
+		s->partial |= r.partial;
+		if (r.first >= 0) {
+			if (s->x0 >= s->x1) {
+				s->x0 = x + r.first;
+				s->x1 = x + r.last + 1;
+				s->y0 = y;
+			} else {
+				s->x0 = min(s->x0, x + (int)r.first);
+				s->x1 = max(s->x1, x + (int)r.last + 1);
+			}
+			s->y1 = y + 1;
+		}
+
+		alpha += m * pitch;
+		s->pos += m;
+		n -= m;
+	}
+}
@@ -0,0 +1,66 @@
+/* Copyright (C) 2019 Nunuhara Cabbage <nunuhara@haniwa.technology>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://gnu.org/licenses/>.
+ */
+
+#ifndef PIXEL_CONV_H
+#define PIXEL_CONV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Pixel format conversion kernels shared by the CG decoders. Each function
+ * converts a run of `n` pixels; RGBA pixels are stored as 4 bytes in R, G, B,
+ * A order. Pointers need not be aligned, and source and destination must not
+ * overlap (except for the in-place conversions).
+ *
+ * SIMD versions (SSE2, AVX2 or NEON) are selected at runtime, and their output
+ * is bit-identical to the scalar code.
+ */
+
+// 24-bit RGB -> RGBA, with opaque alpha
+void pixel_rgb_to_rgba(uint8_t *dst, const uint8_t *src, size_t n);
+// RGB565 -> RGBA, with alpha from `alpha` or opaque if it is NULL
+void pixel_rgb565_to_rgba(uint8_t *dst, const uint16_t *src, const uint8_t *alpha, size_t n);
+// 8-bit alpha -> RGBA, with black colour
+void pixel_alpha_to_rgba(uint8_t *dst, const uint8_t *alpha, size_t n);
+// replace the alpha channel of RGBA pixels (in place)
+void pixel_set_alpha(uint8_t *rgba, const uint8_t *alpha, size_t n);
+// RGBA <-> BGRA (in place)
+void pixel_swap_rb(uint8_t *rgba, size_t n);
+// RGBA -> premultiplied RGBA, rounding to nearest (in place)
+void pixel_premultiply(uint8_t *rgba, size_t n);
+
+/*
+ * Alpha statistics of a w-pixel wide image, accumulated over runs of alpha
+ * values in row-major order. Runs may start and end anywhere in a row.
+ */
+struct pixel_alpha_stats {
+	int w;
+	size_t pos;    // index of the next pixel
+	uint8_t min;
+	uint8_t max;
+	bool partial;  // some alpha value is neither 0 nor 255
+	// bounding box [x0, x1) * [y0, y1) of non-zero alpha, empty if x0 >= x1
+	int x0, y0, x1, y1;
+};
+
+void pixel_alpha_stats_init(struct pixel_alpha_stats *s, int w);
+// add `n` alpha values `pitch` bytes apart (1 for an alpha plane, 4 for the
+// alpha channel of RGBA pixels)
+void pixel_alpha_stats_add(struct pixel_alpha_stats *s, const uint8_t *alpha, size_t pitch, size_t n);
+
+#endif /* PIXEL_CONV_H */
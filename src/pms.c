@@ -21,7 +21,9 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include "cg_decoder.h"
 #include "little_endian.h"
+#include "pixel_conv.h"
 #include "system4.h"
 #include "system4/cg.h"
 #include "system4/pms.h"
@@ -70,160 +72,261 @@ bool pms16_checkfmt(const uint8_t *data)
 	return pms_checkfmt(data) && data[6] == 16;
 }
 
-/* Convert PMS8 image data to bitmap. */
-static uint8_t *pms8_extract(struct pms_header *pms, const uint8_t *b)
+/*
+ * PMS image data is run-length encoded line by line. Each command gives a
+ * literal pixel, repeats one or two pixels, or copies pixels from the line
+ * above or the one before it.
+ *
+ * Lines are decoded one at a time, given the (up to) two lines above, so that
+ * only a few lines need to be kept around. A run that extends past the end of
+ * a line is clipped, since the excess would be overwritten by the next line
+ * anyway. Decoding stops at the first truncated or invalid command; the rest
+ * of the image reads as zeros.
+ */
+struct pms_reader {
+	const uint8_t *p;
+	const uint8_t *end;
+	bool ok;
+};
+
+static void pms_reader_init(struct pms_reader *r, const uint8_t *data, size_t size)
+{
+	r->p = data;
+	r->end = data + size;
+	r->ok = true;
+}
+
+/*
+ * Line buffers have PMS_LINE_SLACK bytes to spare at the end, so that runs can
+ * be copied and filled 8 bytes at a time. Writing past the end of a run is
+ * harmless, since the pixels after it haven't been decoded yet.
+ */
+#define PMS_LINE_SLACK 8
+
+static inline void copy_run(uint8_t *dst, const uint8_t *src, size_t size)
+{
+	for (size_t i = 0; i < size; i += 8)
+		memcpy(dst + i, src + i, 8);
+}
+
+// fill `size` bytes with repetitions of a `pat_size`-byte pattern
+static inline void fill_run(uint8_t *dst, const uint8_t *pat, int pat_size, size_t size)
+{
+	uint8_t word[8];
+	for (int i = 0; i < 8; i++)
+		word[i] = pat[i % pat_size];
+	for (size_t i = 0; i < size; i += 8)
+		memcpy(dst + i, word, 8);
+}
+
+#define NEED(n) do { if (end - p < (n)) goto truncated; } while (0)
+
+/*
+ * Decode a line of PMS8 data. `up1` and `up2` are the previous two lines, or
+ * NULL if they don't exist.
+ */
+static bool pms8_decode_line(struct pms_reader *r, uint8_t *line, const uint8_t *up1,
+		const uint8_t *up2, int w)
 {
-	int n, c0, c1;
-	const int scanline = pms->width;
-	uint8_t *pic = xmalloc((pms->width+10)*(pms->height+10));
-
-	// for each line...
-	for (int y = 0; y < pms->height; y ++) {
-		// for each pixel...
-		for (int x = 0; x < pms->width; ) {
-			int loc = y * scanline + x;
-			c0 = *b++;
-			// non-command byte: read 1 pixel into buffer
-			if (c0 <= 0xf7) {
-				pic[loc] = c0;
-				x++;
-			}
-			// copy n+3 pixels from previous line
-			else if (c0 == 0xff) {
-				n = (*b++) + 3;
-				x += n;
-				memcpy(pic + loc, pic + loc - scanline, n);
-			}
-			// copy n+3 pixels from 2 lines previous
-			else if (c0 == 0xfe) {
-				n = (*b++) + 3;
-				x += n;
-				memcpy(pic + loc, pic + loc - scanline * 2, n);
-			}
-			// repeat 1 pixel n+4 times (1-byte RLE)
-			else if (c0 == 0xfd) {
-				n = (*b++) + 4;
-				x += n;
-				c0 = *b++;
-				memset(pic + loc, c0, n);
-			}
-			// repeast a sequence of 2 pixels n+3 times (2-byte RLE)
-			else if (c0 == 0xfc) {
-				n = ((*b++) + 3)  * 2;
-				x += n;
-				c0 = *b++;
-				c1 = *b++;
-				for (int i = 0; i < n; i+=2) {
-					pic[loc+i]   = c0;
-					pic[loc+i+1] = c1;
-				}
-			}
-			// not sure why this exists, probably padding
-			else {
-				pic[loc] = *b++;
-				x++;
-			}
+	const uint8_t *p = r->p, *end = r->end;
+	int x = 0;
+	if (!r->ok)
+		goto fail;
+
+	while (x < w) {
+		NEED(1);
+		int n, c0 = *p;
+		// non-command bytes: a run of literal pixels
+		if (c0 <= 0xf7) {
+			do {
+				line[x++] = *p++;
+			} while (x < w && p < end && *p <= 0xf7);
+			continue;
+		}
+		p++;
+		switch (c0) {
+		// copy n+3 pixels from the previous line, or from 2 lines previous
+		case 0xff:
+		case 0xfe: {
+			const uint8_t *src = c0 == 0xff ? up1 : up2;
+			NEED(1);
+			if (!src)
+				goto invalid;
+			n = *p++ + 3;
+			copy_run(line + x, src + x, min(n, w - x));
+			x += n;
+			break;
+		}
+		// repeat 1 pixel n+4 times (1-byte RLE)
+		case 0xfd:
+			NEED(2);
+			n = p[0] + 4;
+			fill_run(line + x, p + 1, 1, min(n, w - x));
+			p += 2;
+			x += n;
+			break;
+		// repeat a sequence of 2 pixels n+3 times (2-byte RLE)
+		case 0xfc:
+			NEED(3);
+			n = (p[0] + 3) * 2;
+			fill_run(line + x, p + 1, 2, min(n, w - x));
+			p += 3;
+			x += n;
+			break;
+		// not sure why this exists, probably padding
+		default:
+			NEED(1);
+			line[x++] = *p++;
+			break;
 		}
 	}
-
-	return pic;
+	r->p = p;
+	return true;
+truncated:
+	WARNING("PMS data truncated");
+	r->ok = false;
+	goto fail;
+invalid:
+	WARNING("Invalid PMS data");
+	r->ok = false;
+fail:
+	memset(line + x, 0, w - x);
+	return false;
 }
 
-/* Convert PMS16 image data to bitmap. */
-static uint16_t *pms16_extract(struct pms_header *pms, const uint8_t *b)
+static inline uint16_t pms16_combine(int c0, int c1)
 {
-	int n, c0, c1, pc0, pc1;
-	const int scanline = pms->width;
-	uint16_t *pic = xmalloc(sizeof(uint16_t) * (pms->width+10) * (pms->height+10));
+	int pc0 = ((c0 & 0xe0) << 8) + ((c0 & 0x18) << 6) + ((c0 & 0x07) << 2);
+	int pc1 = ((c1 & 0xc0) << 5) + ((c1 & 0x3c) << 3) + (c1 & 0x03);
+	return pc0 | pc1;
+}
 
-	for (int y = 0; y < pms->height; y++) {
-		for (int x = 0; x < pms->width;) {
-			int loc = y * scanline + x;
-			c0 = *b++;
-			// non-command byte: read 1 pixel into buffer
-			if (c0 <= 0xf7) {
-				c1 = *b++;
-				x++;
-				pic[loc] = c0 | (c1 << 8);
-			}
-			// copy n+2 pixels from previous line into buffer
-			else if (c0 == 0xff) {
-				n = (*b++) + 2;
-				x += n;
-				for (int i = 0; i < n; i++) {
-					pic[loc + i] = pic[loc + i - scanline];
-				}
-			}
-			// copy n+2 pixels from 2 lines previous
-			else if (c0 == 0xfe) {
-				n = (*b++) + 2;
-				x += n;
-				for (int i = 0; i < n; i++) {
-					pic[loc + i] = pic[loc + i - scanline * 2];
-				}
-			}
-			// repeat a pixel n+3 times (1-byte RLE)
-			else if (c0 == 0xfd) {
-				n = (*b++) + 3;
-				x += n;
-				c0 = *b++;
-				c1 = *b++;
-				pc0 = c0 | (c1 << 8);
-				for (int i = 0; i < n; i++) {
-					pic[loc + i] = pc0;
-				}
-			}
-			// repeat a sequence of 2 pixels n+2 times (2-byte RLE)
-			else if (c0 == 0xfc) {
-				n = ((*b++) + 2) * 2;
-				x += n;
-				c0 = *b++;
-				c1 = *b++;
-				pc0 = c0 | (c1 << 8);
-				c0 = *b++;
-				c1 = *b++;
-				pc1 = c0 | (c1 << 8);
-				for (int i = 0; i < n; i+=2) {
-					pic[loc + i    ] = pc0;
-					pic[loc + i + 1] = pc1;
-				}
-			}
-			// copy 1 pixel from previous line (left diagonal)
-			else if (c0 == 0xfb) {
-				x++;
-				pic[loc] = pic[loc - scanline - 1];
-			}
-			// copy 1 pixel from previous line (right diagonal)
-			else if (c0 == 0xfa) {
-				x++;
-				pic[loc] = pic[loc - scanline + 1];
-			}
-			// this one's a bit tricky, but basically what this does is it
-			// combines one byte with the next n bytes
-			else if (c0 == 0xf9) {
-				n = (*b++) + 1;
-				x += n;
-				c0 = *b++;
-				c1 = *b++;
-				pc0 = ((c0 & 0xe0)<<8) + ((c0 & 0x18)<<6) + ((c0 & 0x07)<<2);
-				pc1 = ((c1 & 0xc0)<<5) + ((c1 & 0x3c)<<3) + (c1 & 0x03);
-				pic[loc] = pc0 + pc1;
-				for (int i = 1; i < n; i++) {
-					c1 = *b++;
-					pc1 = ((c1 & 0xc0)<<5) + ((c1 & 0x3c)<<3) + (c1 & 0x03);
-					pic[loc + i] = pc0 | pc1;
-				}
-			}
-			// not sure why this exists, probably padding
-			else {
-				c0 = *b++;
-				c1 = *b++;
-				x++;
-				pic[loc] = c0 | (c1 << 8);
-			}
+/*
+ * Decode a line of PMS16 data. `up1` and `up2` are the previous two lines, or
+ * NULL if they don't exist.
+ */
+static bool pms16_decode_line(struct pms_reader *r, uint16_t *line, const uint16_t *up1,
+		const uint16_t *up2, int w)
+{
+	const uint8_t *p = r->p, *end = r->end;
+	int x = 0;
+	if (!r->ok)
+		goto fail;
+
+	while (x < w) {
+		NEED(1);
+		int n, c0 = *p;
+		// non-command bytes: a run of literal pixels
+		if (c0 <= 0xf7) {
+			do {
+				NEED(2);
+				line[x++] = p[0] | (p[1] << 8);
+				p += 2;
+			} while (x < w && p < end && *p <= 0xf7);
+			continue;
+		}
+		p++;
+		switch (c0) {
+		// copy n+2 pixels from the previous line, or from 2 lines previous
+		case 0xff:
+		case 0xfe: {
+			const uint16_t *src = c0 == 0xff ? up1 : up2;
+			NEED(1);
+			if (!src)
+				goto invalid;
+			n = *p++ + 2;
+			copy_run((uint8_t*)(line + x), (const uint8_t*)(src + x), min(n, w - x) * 2);
+			x += n;
+			break;
+		}
+		// repeat a pixel n+3 times (1-byte RLE)
+		case 0xfd:
+			NEED(3);
+			n = p[0] + 3;
+			fill_run((uint8_t*)(line + x), p + 1, 2, min(n, w - x) * 2);
+			p += 3;
+			x += n;
+			break;
+		// repeat a sequence of 2 pixels n+2 times (2-byte RLE)
+		case 0xfc:
+			NEED(5);
+			n = (p[0] + 2) * 2;
+			fill_run((uint8_t*)(line + x), p + 1, 4, min(n, w - x) * 2);
+			p += 5;
+			x += n;
+			break;
+		// copy 1 pixel from previous line (left diagonal)
+		case 0xfb:
+			if (x > 0 ? !up1 : !up2)
+				goto invalid;
+			line[x] = x > 0 ? up1[x - 1] : up2[w - 1];
+			x++;
+			break;
+		// copy 1 pixel from previous line (right diagonal); past the end of
+		// the line, this wraps around to the start of the current line
+		case 0xfa:
+			if (x + 1 < w && !up1)
+				goto invalid;
+			line[x] = x + 1 < w ? up1[x + 1] : x ? line[0] : 0;
+			x++;
+			break;
+		// this one's a bit tricky, but basically what this does is it
+		// combines one byte with the next n bytes
+		case 0xf9:
+			NEED(3);
+			n = p[0] + 1;
+			c0 = p[1];
+			p += 2;
+			NEED(n);
+			for (int i = 0, m = min(n, w - x); i < m; i++)
+				line[x + i] = pms16_combine(c0, p[i]);
+			p += n;
+			x += n;
+			break;
+		// not sure why this exists, probably padding
+		default:
+			NEED(2);
+			line[x++] = p[0] | (p[1] << 8);
+			p += 2;
+			break;
 		}
 	}
+	r->p = p;
+	return true;
+truncated:
+	WARNING("PMS data truncated");
+	r->ok = false;
+	goto fail;
+invalid:
+	WARNING("Invalid PMS data");
+	r->ok = false;
+fail:
+	memset(line + x, 0, (w - x) * 2);
+	return false;
+}
+
+#undef NEED
+
+/*
+ * Get line `y` of a ring buffer holding the last three lines of a plane, or
+ * NULL if y < 0.
+ */
+static void *pms_ring_line(void *ring, size_t pitch, int y)
+{
+	return y < 0 ? NULL : (uint8_t*)ring + (y % 3) * pitch;
+}
 
+/* Decode a whole PMS8 plane. */
+static uint8_t *pms8_extract(struct pms_header *pms, const uint8_t *b, size_t size)
+{
+	const size_t w = pms->width;
+	uint8_t *pic = xmalloc(w * pms->height + PMS_LINE_SLACK);
+	struct pms_reader r;
+	pms_reader_init(&r, b, size);
+	for (int y = 0; y < pms->height; y++) {
+		uint8_t *line = pic + y * w;
+		pms8_decode_line(&r, line, y > 0 ? line - w : NULL, y > 1 ? line - 2 * w : NULL, w);
+	}
 	return pic;
 }
 
@@ -265,50 +368,86 @@ bool pms_get_metrics(const uint8_t *data, struct cg_metrics *dst)
 	return true;
 }
 
-/* Load a PMS8 CG as an alpha-map. */
-static void pms8_load(const uint8_t *data, struct pms_header *pms, struct cg *cg)
+/*
+ * Load the region (x, y, w, h) of a PMS8 CG as an alpha-map. Lines below the
+ * region are not decoded.
+ */
+static void pms8_load(const uint8_t *data, size_t size, struct pms_header *pms, struct cg *cg,
+		int x, int y, int w, int h)
 {
 	cg->type = ALCG_PMS8;
-	uint8_t *alpha = pms8_extract(pms, data + pms->dp);
-
-	// Convert to RGBA
-	cg->pixels = xmalloc(pms->width * pms->height * 4);
-	uint32_t *dst = cg->pixels;
-	for (int i = 0; i < pms->width * pms->height; i++) {
-		dst[i] = alpha[i] << 24;
+	const size_t pitch = pms->width + PMS_LINE_SLACK;
+	uint8_t *ring = xmalloc(pitch * 3);
+	struct pms_reader r;
+	pms_reader_init(&r, data + pms->dp, size - pms->dp);
+	struct pixel_alpha_stats stats, *s = cg_alpha_stats_begin(&stats, w);
+
+	cg->pixels = xmalloc(max((size_t)w * h, (size_t)1) * 4);
+	for (int row = 0; row < y + h; row++) {
+		uint8_t *line = pms_ring_line(ring, pitch, row);
+		pms8_decode_line(&r, line, pms_ring_line(ring, pitch, row - 1),
+				pms_ring_line(ring, pitch, row - 2), pms->width);
+		if (row < y)
+			continue;
+		pixel_alpha_to_rgba((uint8_t*)cg->pixels + (size_t)(row - y) * w * 4, line + x, w);
+		if (s)
+			pixel_alpha_stats_add(s, line + x, 1, w);
 	}
 
-	free(alpha);
-}
-
-static uint32_t RGB565to8888(uint16_t pc, uint8_t a)
-{
-	unsigned r = pc & 0xf800;
-	unsigned g = pc & 0x07e0;
-	unsigned b = pc & 0x001f;
-	r = r >> 8 | r >> 13;
-	g = g >> 3 | g >> 9;
-	b = b << 3 | b >> 2;
-	return r | g << 8 | b << 16 | a << 24;
+	free(ring);
+	cg_alpha_stats_end(cg, s);
 }
 
-static void pms16_load(const uint8_t *data, struct pms_header *pms, struct cg *cg)
+/*
+ * Load the region (x, y, w, h) of a PMS16 CG. The pixel and alpha planes are
+ * decoded together, and each line is converted to RGBA as soon as it is done.
+ */
+static void pms16_load(const uint8_t *data, size_t size, struct pms_header *pms, struct cg *cg,
+		int x, int y, int w, int h)
 {
 	cg->type = ALCG_PMS16;
-	uint16_t *pixels = pms16_extract(pms, data + pms->dp);
-	uint8_t *alpha = pms->pp ? pms8_extract(pms, data + pms->pp) : NULL;
-
-	// Convert to RGBA
-	cg->pixels = xmalloc(pms->width * pms->height * 4);
-	uint32_t *dst = cg->pixels;
-	for (int i = 0; i < pms->width * pms->height; i++)
-		dst[i] = RGB565to8888(pixels[i], alpha ? alpha[i] : 0xff);
+	const size_t pitch = pms->width * 2 + PMS_LINE_SLACK;
+	const size_t alpha_pitch = pms->width + PMS_LINE_SLACK;
+	uint16_t *ring = xmalloc(pitch * 3);
+	uint8_t *alpha_ring = pms->pp ? xmalloc(alpha_pitch * 3) : NULL;
+	struct pms_reader r, alpha_r;
+	pms_reader_init(&r, data + pms->dp, size - pms->dp);
+	if (alpha_ring)
+		pms_reader_init(&alpha_r, data + pms->pp, size - pms->pp);
+	struct pixel_alpha_stats stats, *s = alpha_ring ? cg_alpha_stats_begin(&stats, w) : NULL;
+
+	cg->pixels = xmalloc(max((size_t)w * h, (size_t)1) * 4);
+	for (int row = 0; row < y + h; row++) {
+		uint16_t *line = pms_ring_line(ring, pitch, row);
+		pms16_decode_line(&r, line, pms_ring_line(ring, pitch, row - 1),
+				pms_ring_line(ring, pitch, row - 2), pms->width);
+		uint8_t *alpha = NULL;
+		if (alpha_ring) {
+			alpha = pms_ring_line(alpha_ring, alpha_pitch, row);
+			pms8_decode_line(&alpha_r, alpha, pms_ring_line(alpha_ring, alpha_pitch, row - 1),
+					pms_ring_line(alpha_ring, alpha_pitch, row - 2), pms->width);
+		}
+		if (row < y)
+			continue;
+		pixel_rgb565_to_rgba((uint8_t*)cg->pixels + (size_t)(row - y) * w * 4, line + x,
+				alpha ? alpha + x : NULL, w);
+		if (s)
+			pixel_alpha_stats_add(s, alpha + x, 1, w);
+	}
 
-	free(pixels);
-	free(alpha);
+	free(ring);
+	free(alpha_ring);
+	if (alpha_ring)
+		cg_alpha_stats_end(cg, s);
+	else
+		cg_set_opaque(cg);
 }
 
-void pms_extract(const uint8_t *data, size_t size, struct cg *cg)
+/*
+ * Extract the region (x, y, w, h) of a PMS CG, which must lie within the image.
+ * Decoding stops after the last line of the region.
+ */
+void pms_extract_rect(const uint8_t *data, size_t size, struct cg *cg, int x, int y, int w, int h)
 {
 	struct pms_header pms;
 	pms_read_header(&pms, data);
@@ -323,14 +462,23 @@ void pms_extract(const uint8_t *data, size_t size, struct cg *cg)
 		return;
 	}
 
+	cg->metrics.w = w;
+	cg->metrics.h = h;
 	if (pms.bpp == 8)
-		pms8_load(data, &pms, cg);
+		pms8_load(data, size, &pms, cg, x, y, w, h);
 	else if (pms.bpp == 16)
-		pms16_load(data, &pms, cg);
+		pms16_load(data, size, &pms, cg, x, y, w, h);
 	else
 		WARNING("Unsupported PMS bpp: %d", pms.bpp);
 }
 
+void pms_extract(const uint8_t *data, size_t size, struct cg *cg)
+{
+	struct pms_header pms;
+	pms_read_header(&pms, data);
+	pms_extract_rect(data, size, cg, 0, 0, pms.width, pms.height);
+}
+
 uint8_t *pms_extract_mask(const uint8_t *data, size_t size)
 {
 	struct pms_header pms;
@@ -350,5 +498,5 @@ uint8_t *pms_extract_mask(const uint8_t *data, size_t size)
 		return NULL;
 	}
 
-	return pms8_extract(&pms, data + pms.dp);
+	return pms8_extract(&pms, data + pms.dp, size - pms.dp);
 }
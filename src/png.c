@@ -25,7 +25,9 @@
 #include "system4/cg.h"
 #include "system4/png.h"
 
+#include "cg_decoder.h"
 #include "little_endian.h"
+#include "pixel_conv.h"
 
 bool png_cg_checkfmt(const uint8_t *data)
 {
@@ -44,34 +46,27 @@ static void read_png_data(png_structp png_ptr, png_bytep out, size_t length)
 	buffer_read_bytes(buf, out, length);
 }
 
-static void extract_rgb(png_structp png_ptr, png_infop info_ptr, struct cg *cg)
+static void extract_rgb(png_structp png_ptr, png_infop info_ptr, struct cg_metrics *m,
+		uint8_t *pixels, size_t stride)
 {
 	const png_uint_32 row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-	uint8_t *row_data = xmalloc(row_bytes);
-	uint8_t *pixels = cg->pixels;
+	uint8_t *row_data = cg_decoder_scratch(cg_decoder_ctx_get(), row_bytes);
 
-	for (int row = 0; row < cg->metrics.h; row++) {
+	for (int row = 0; row < m->h; row++) {
 		png_read_row(png_ptr, (png_bytep)row_data, NULL);
-		int row_off = row * cg->metrics.w * 4;
-		int i = 0;
-		for (int col = 0; col < cg->metrics.w; col++) {
-			pixels[row_off + col*4 + 0] = row_data[i++];
-			pixels[row_off + col*4 + 1] = row_data[i++];
-			pixels[row_off + col*4 + 2] = row_data[i++];
-			pixels[row_off + col*4 + 3] = 0xFF;
-		}
+		pixel_rgb_to_rgba(pixels + row * stride, row_data, m->w);
 	}
-
-	free(row_data);
 }
 
-static void extract_rgba(png_structp png_ptr, png_infop info_ptr, struct cg *cg)
+static void extract_rgba(png_structp png_ptr, png_infop info_ptr, struct cg_metrics *m,
+		uint8_t *pixels, size_t stride, struct pixel_alpha_stats *stats)
 {
-	assert((int)png_get_rowbytes(png_ptr, info_ptr) == cg->metrics.w*4);
+	assert((int)png_get_rowbytes(png_ptr, info_ptr) == m->w*4);
 
-	for (int row = 0; row < cg->metrics.h; row++) {
-		uint8_t *row_data = (uint8_t*)cg->pixels + row*cg->metrics.w*4;
-		png_read_row(png_ptr, (png_bytep)row_data, NULL);
+	for (int row = 0; row < m->h; row++) {
+		png_read_row(png_ptr, (png_bytep)(pixels + row * stride), NULL);
+		if (stats)
+			pixel_alpha_stats_add(stats, pixels + row * stride + 3, 4, m->w);
 	}
 }
 
@@ -162,15 +157,96 @@ void png_cg_extract(const uint8_t *data, size_t size, struct cg *cg)
 
 	cg->pixels = xmalloc(cg->metrics.w * cg->metrics.h * 4);
 	if (cg->metrics.has_alpha) {
-		extract_rgba(png_ptr, info_ptr, cg);
+		struct pixel_alpha_stats stats, *s = cg_alpha_stats_begin(&stats, cg->metrics.w);
+		extract_rgba(png_ptr, info_ptr, &cg->metrics, cg->pixels, cg->metrics.w * 4, s);
+		cg_alpha_stats_end(cg, s);
 	} else {
-		extract_rgb(png_ptr, info_ptr, cg);
+		extract_rgb(png_ptr, info_ptr, &cg->metrics, cg->pixels, cg->metrics.w * 4);
+		cg_set_opaque(cg);
 	}
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 }
 
-int png_cg_write(struct cg *cg, FILE *f)
+/*
+ * Extract the region (x, y, w, h) of a PNG, which must lie within the image.
+ * Rows below the region are not decompressed.
+ */
+void png_cg_extract_rect(const uint8_t *data, size_t size, struct cg *cg, int x, int y, int w, int h)
+{
+	struct buffer buf;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+
+	buffer_init(&buf, (uint8_t*)data, size);
+	if (!png_read_init(&png_ptr, &info_ptr, &cg->metrics, &buf))
+		return;
+
+	const png_uint_32 row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+	uint8_t *row_data = cg_decoder_scratch(cg_decoder_ctx_get(), row_bytes);
+	uint8_t *pixels = xmalloc(w * h * 4);
+	struct pixel_alpha_stats stats, *s = cg_alpha_stats_begin(&stats, w);
+	for (int row = 0; row < y + h; row++) {
+		png_read_row(png_ptr, (png_bytep)row_data, NULL);
+		if (row < y)
+			continue;
+		uint8_t *dst = pixels + (row - y) * w * 4;
+		if (cg->metrics.has_alpha) {
+			memcpy(dst, row_data + x * 4, w * 4);
+			if (s)
+				pixel_alpha_stats_add(s, dst + 3, 4, w);
+		} else {
+			pixel_rgb_to_rgba(dst, row_data + x * 3, w);
+		}
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	cg->pixels = pixels;
+	if (cg->metrics.has_alpha)
+		cg_alpha_stats_end(cg, s);
+	else
+		cg_set_opaque(cg);
+}
+
+bool png_cg_extract_into(const uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr)
+{
+	struct buffer buf;
+	struct cg_metrics metrics;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+
+	buffer_init(&buf, (uint8_t*)data, size);
+	if (!png_read_init(&png_ptr, &info_ptr, &metrics, &buf))
+		return false;
+
+	// libpng swaps the rows as it reads them (before RGB is widened to RGBA)
+	if (bgr)
+		png_set_bgr(png_ptr);
+	if (metrics.has_alpha) {
+		extract_rgba(png_ptr, info_ptr, &metrics, dst, stride, NULL);
+	} else {
+		extract_rgb(png_ptr, info_ptr, &metrics, dst, stride);
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	return true;
+}
+
+static void write_png_data(png_structp png_ptr, png_bytep data, size_t length)
+{
+	buffer_write_bytes(png_get_io_ptr(png_ptr), data, length);
+}
+
+static void flush_png_data(possibly_unused png_structp png_ptr)
+{
+}
+
+/*
+ * Encode a CG as PNG, either to `f` or (if `f` is NULL) to `out`.
+ */
+static int png_cg_write_internal(struct cg *cg, FILE *f, struct buffer *out)
 {
 	int r = 0;
 	png_structp png_ptr = NULL;
@@ -194,7 +270,10 @@ int png_cg_write(struct cg *cg, FILE *f)
 		goto cleanup;
 	}
 
-	png_init_io(png_ptr, f);
+	if (f)
+		png_init_io(png_ptr, f);
+	else
+		png_set_write_fn(png_ptr, out, write_png_data, flush_png_data);
 
 	if (setjmp(png_jmpbuf(png_ptr))) {
 		WARNING("png_write_header failed");
@@ -234,3 +313,12 @@ cleanup:
 	return r;
 }
 
+int png_cg_write(struct cg *cg, FILE *f)
+{
+	return png_cg_write_internal(cg, f, NULL);
+}
+
+int png_cg_encode(struct cg *cg, struct buffer *out)
+{
+	return png_cg_write_internal(cg, NULL, out);
+}
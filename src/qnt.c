@@ -23,19 +23,19 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <zlib.h>
+#include "cg_decoder.h"
 #include "little_endian.h"
+#include "pixel_conv.h"
 #include "system4.h"
+#include "system4/buffer.h"
 #include "system4/cg.h"
 #include "system4/qnt.h"
 
-/*
-  zlib の展開バッファで、幅×高さ×３に、さらにどれくらい余裕をとるか
-   (リクルスで 1164バイトというのがあった)
-*/
-#define ZLIBBUF_MARGIN 5*1024
-
 /*
  * Get information from header
  *
@@ -74,135 +74,634 @@ void qnt_extract_header(const uint8_t *b, struct qnt_header *qnt)
 }
 
 /*
- * Do extract qnt pixel image
+ * The colour data is stored as three planes (B, G, R), in which each 2x2
+ * block of pixels is stored as 4 consecutive bytes, column by column. The
+ * alpha data is a single plane stored row by row, with rows padded to an even
+ * width. Every channel is delta-coded against the average of the pixels above
+ * and to the left.
  *
- *   qnt: qnt header information
- *   pic: pixel to be stored
- *   b  : raw data (pointer to pixel)
+ * The planes are inflated in small chunks and scattered directly into the
+ * RGBA image, two-row band by band: first the B plane together with the alpha
+ * plane (which is a separate zlib stream), then the G plane. As the bands of
+ * the R plane come in, the image is complete up to that band and the
+ * predictor is undone while the rows are still in cache.
  */
-static void extract_pixel(struct qnt_header *qnt, uint8_t *pic, const uint8_t *b)
+
+// bytes of each plane inflated at a time
+#define QNT_CHUNK_SIZE (32 * 1024)
+
+struct plane_reader {
+	z_stream *z;
+	bool ok;
+};
+
+/*
+ * Start reading a plane on the decoder context's inflate stream `i`.
+ */
+static void plane_reader_init(struct plane_reader *r, struct cg_decoder_ctx *ctx, int i,
+		const uint8_t *b, int compressed_size)
 {
-	int i, j, x, y, w, h;
-	unsigned long ucbuf = (qnt->width+1) * (qnt->height+1) * 3 + ZLIBBUF_MARGIN;
-	uint8_t *raw = malloc(sizeof(uint8_t) * ucbuf);
+	r->z = cg_decoder_inflate(ctx, i, b, compressed_size);
+	r->ok = r->z != NULL;
+}
 
-	if (Z_OK != uncompress(raw, &ucbuf, b, qnt->pixel_size)) {
-		WARNING("uncompress failed\n");
-		free(raw);
+/*
+ * Inflate the next `size` bytes of a plane. Whatever can't be inflated (from a
+ * truncated or corrupt stream) reads as zeros.
+ */
+static void plane_reader_read(struct plane_reader *r, uint8_t *buf, size_t size)
+{
+	if (!r->z) {
+		memset(buf, 0, size);
 		return;
 	}
+	r->z->next_out = buf;
+	r->z->avail_out = size;
+	while (r->ok && r->z->avail_out) {
+		int rv = inflate(r->z, Z_SYNC_FLUSH);
+		if (rv == Z_STREAM_END)
+			break;
+		if (rv != Z_OK) {
+			WARNING("uncompress failed");
+			r->ok = false;
+		}
+	}
+	memset(r->z->next_out, 0, r->z->avail_out);
+}
+
+/*
+ * Inflate the rest of the stream, so that the checksum is verified. Returns
+ * false if the stream was not fully valid.
+ */
+static bool plane_reader_end(struct plane_reader *r)
+{
+	uint8_t buf[256];
+	while (r->ok) {
+		r->z->next_out = buf;
+		r->z->avail_out = sizeof(buf);
+		int rv = inflate(r->z, Z_SYNC_FLUSH);
+		if (rv == Z_STREAM_END)
+			break;
+		if (rv != Z_OK) {
+			WARNING("uncompress failed");
+			r->ok = false;
+		}
+	}
+	return r->ok;
+}
+
+/*
+ * Store the deltas of a two-row band of the B and alpha planes into the RGBA
+ * image (clearing R and G), starting at the (even) column `x`. `plane` points
+ * to the band in the B plane, and `alpha` to the first row of the band in the
+ * alpha plane, or is NULL. B goes in channel `c`: 2 for RGBA, or 0 for BGRA.
+ */
+static void unpack_band_from(uint8_t *rgba, size_t stride, const uint8_t *plane, const uint8_t *alpha,
+		int c, int w, int h, int y, int x)
+{
+	int pw = (w + 1) & ~1;
+	uint8_t *row0 = rgba + y * stride;
+	uint8_t *row1 = y + 1 < h ? row0 + stride : NULL;
+	const uint8_t *b = plane + x * 2;
+	const uint8_t *a0 = alpha, *a1 = alpha ? alpha + pw : NULL;
+
+	for (; x < w; x += 2, b += 4) {
+		uint8_t *p = row0 + x * 4;
+		p[0] = p[1] = p[2] = 0; p[c] = b[0]; p[3] = a0 ? a0[x] : 0;
+		if (x + 1 < w) {
+			p[4] = p[5] = p[6] = 0; p[4+c] = b[2]; p[7] = a0 ? a0[x+1] : 0;
+		}
+		if (!row1)
+			continue;
+		p = row1 + x * 4;
+		p[0] = p[1] = p[2] = 0; p[c] = b[1]; p[3] = a1 ? a1[x] : 0;
+		if (x + 1 < w) {
+			p[4] = p[5] = p[6] = 0; p[4+c] = b[3]; p[7] = a1 ? a1[x+1] : 0;
+		}
+	}
+}
 
-	w = qnt->width;
-	h = qnt->height;
+static void unpack_band(uint8_t *rgba, size_t stride, const uint8_t *plane, const uint8_t *alpha, int c,
+		int w, int h, int y)
+{
+	unpack_band_from(rgba, stride, plane, alpha, c, w, h, y, 0);
+}
+
+/*
+ * Fill in the deltas of a two-row band of the G or R plane into channel `c` of
+ * an image band stored by unpack_band().
+ */
+static void merge_band_from(uint8_t *rgba, size_t stride, const uint8_t *plane, int c, int w, int h, int y, int x)
+{
+	uint8_t *row0 = rgba + y * stride + c;
+	uint8_t *row1 = y + 1 < h ? row0 + stride : NULL;
+	const uint8_t *p = plane + x * 2;
 
-	j = 0;
-	for (i = 2; i >= 0; i--) {
-		for (y = 0; y < (h -1); y+=2) {
-			for (x = 0; x < (w -1); x+=2) {
-				pic[( y   *w+x)  *3 +i] = raw[j];
-				pic[((y+1)*w+x)  *3 +i] = raw[j+1];
-				pic[( y   *w+x+1)*3 +i] = raw[j+2];
-				pic[((y+1)*w+x+1)*3 +i] = raw[j+3];
-				j+=4;
+	for (; x < w; x += 2, p += 4) {
+		row0[x*4] = p[0];
+		if (x + 1 < w)
+			row0[x*4+4] = p[2];
+		if (!row1)
+			continue;
+		row1[x*4] = p[1];
+		if (x + 1 < w)
+			row1[x*4+4] = p[3];
+	}
+}
+
+static void merge_band(uint8_t *rgba, size_t stride, const uint8_t *plane, int c, int w, int h, int y)
+{
+	merge_band_from(rgba, stride, plane, c, w, h, y, 0);
+}
+
+/*
+ * Per-channel (a + b) >> 1 and a - b on four 8-bit channels packed into a
+ * 32-bit word.
+ */
+static inline uint32_t avg_u8x4(uint32_t a, uint32_t b)
+{
+	return (a & b) + (((a ^ b) & 0xfefefefe) >> 1);
+}
+
+static inline uint32_t sub_u8x4(uint32_t a, uint32_t b)
+{
+	return ((a | 0x80808080) - (b & 0x7f7f7f7f)) ^ ((a ^ ~b) & 0x80808080);
+}
+
+/*
+ * Undo the delta coding of a row of RGBA pixels. `up` is the previous
+ * (already decoded) row, or NULL for the first row. `fill` is OR'd into every
+ * pixel, so that the alpha channel can be forced to 0xff.
+ */
+static void predict_row(uint32_t *row, const uint32_t *up, int w, uint32_t fill)
+{
+	uint32_t left = up ? sub_u8x4(up[0], row[0]) : row[0];
+	row[0] = left |= fill;
+	if (!up) {
+		for (int x = 1; x < w; x++)
+			row[x] = left = sub_u8x4(left, row[x]) | fill;
+		return;
+	}
+	for (int x = 1; x < w; x++)
+		row[x] = left = sub_u8x4(avg_u8x4(up[x], left), row[x]) | fill;
+}
+
+/*
+ * Undo the delta coding of the pixels [x0, x1) of a row other than the first.
+ */
+possibly_unused static void predict_span(uint32_t *row, const uint32_t *up, int x0, int x1, uint32_t fill)
+{
+	for (int x = x0; x < x1; x++)
+		row[x] = sub_u8x4(x ? avg_u8x4(up[x], row[x-1]) : up[0], row[x]) | fill;
+}
+
+static void predict_rows(uint32_t *rgba, size_t stride, int w, int y, uint32_t fill)
+{
+	uint32_t *row = rgba + y * (stride / 4);
+	predict_row(row, row - stride / 4, w, fill);
+}
+
+/*
+ * SIMD kernels
+ *
+ * The de-interleave splits the even and odd bytes of a plane into the two
+ * rows of a band and widens them to 32-bit pixels, 8 or 16 pixels at a time.
+ *
+ * The predictor has a serial dependency along each row, but since a pixel
+ * only depends on its left and upper neighbours, N rows can be decoded
+ * together as a diagonal wavefront: at step t, lane i decodes pixel (t-i, y+i).
+ * The left neighbour of a lane is its own previous result, and the upper
+ * neighbour is the previous result of lane i-1 (or row y-1, for lane 0). The
+ * triangles at both ends of the wavefront are decoded with predict_span().
+ *
+ * The output of every kernel is bit-identical to the scalar code.
+ */
+
+struct qnt_kernels {
+	void (*unpack_band)(uint8_t *rgba, size_t stride, const uint8_t *plane, const uint8_t *alpha,
+			int c, int w, int h, int y);
+	void (*merge_band)(uint8_t *rgba, size_t stride, const uint8_t *plane, int c, int w, int h, int y);
+	// undo the delta coding of `rows` rows, starting at row y (y > 0)
+	void (*predict_rows)(uint32_t *rgba, size_t stride, int w, int y, uint32_t fill);
+	int rows;
+};
+
+possibly_unused static const struct qnt_kernels qnt_kernels_scalar = {
+	.unpack_band = unpack_band,
+	.merge_band = merge_band,
+	.predict_rows = predict_rows,
+	.rows = 1,
+};
+
+#define WAVEFRONT_BEGIN(n)						\
+	size_t pitch = stride / 4;					\
+	uint32_t *r[n];							\
+	for (int i = 0; i < n; i++)					\
+		r[i] = rgba + (y + i) * pitch;				\
+	const uint32_t *up = r[0] - pitch;				\
+	if (w < n) {							\
+		for (int i = 0; i < n; i++)				\
+			predict_row(r[i], r[i] - pitch, w, fill);	\
+		return;							\
+	}								\
+	for (int i = 0; i < n; i++)					\
+		predict_span(r[i], r[i] - pitch, 0, n - i, fill)
+
+#define WAVEFRONT_END(n)						\
+	for (int i = 1; i < n; i++)					\
+		predict_span(r[i], r[i] - pitch, w - i, w, fill)
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static void unpack_band_sse2(uint8_t *rgba, size_t stride, const uint8_t *plane, const uint8_t *alpha,
+		int c, int w, int h, int y)
+{
+	int x = 0;
+	if (y + 1 < h) {
+		int pw = (w + 1) & ~1;
+		uint8_t *row0 = rgba + y * stride;
+		uint8_t *row1 = row0 + stride;
+		const __m128i mask = _mm_set1_epi16(0xff), zero = _mm_setzero_si128();
+		__m128i a = zero;
+		for (; x + 8 <= w; x += 8) {
+			// even bytes go to row y, odd bytes to row y+1
+			__m128i b = _mm_loadu_si128((const __m128i*)(plane + x * 2));
+			b = _mm_packus_epi16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8));
+			if (alpha) {
+				a = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(alpha + x)),
+						       _mm_loadl_epi64((const __m128i*)(alpha + pw + x)));
 			}
-			if (x != w) {
-				pic[( y   *w+x)*3 +i] = raw[j];
-				pic[((y+1)*w+x)*3 +i] = raw[j+1];
-				j+=4;
+			// the low and high 16 bits of each pixel of rows y and y+1
+			__m128i l0 = zero, l1 = zero, h0, h1;
+			if (c == 2) {
+				h0 = _mm_unpacklo_epi8(b, a);
+				h1 = _mm_unpackhi_epi8(b, a);
+			} else {
+				l0 = _mm_unpacklo_epi8(b, zero);
+				l1 = _mm_unpackhi_epi8(b, zero);
+				h0 = _mm_unpacklo_epi8(zero, a);
+				h1 = _mm_unpackhi_epi8(zero, a);
 			}
+			__m128i *p0 = (__m128i*)(row0 + x * 4), *p1 = (__m128i*)(row1 + x * 4);
+			_mm_storeu_si128(p0,     _mm_unpacklo_epi16(l0, h0));
+			_mm_storeu_si128(p0 + 1, _mm_unpackhi_epi16(l0, h0));
+			_mm_storeu_si128(p1,     _mm_unpacklo_epi16(l1, h1));
+			_mm_storeu_si128(p1 + 1, _mm_unpackhi_epi16(l1, h1));
+		}
+	}
+	unpack_band_from(rgba, stride, plane, alpha, c, w, h, y, x);
+}
+
+static void merge_band_sse2(uint8_t *rgba, size_t stride, const uint8_t *plane, int c, int w, int h, int y)
+{
+	int x = 0;
+	if (y + 1 < h) {
+		uint8_t *row0 = rgba + y * stride;
+		uint8_t *row1 = row0 + stride;
+		const __m128i mask = _mm_set1_epi16(0xff), zero = _mm_setzero_si128();
+		const __m128i shift = _mm_cvtsi32_si128(c * 8);
+		for (; x + 8 <= w; x += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(plane + x * 2));
+			__m128i v0 = _mm_and_si128(v, mask), v1 = _mm_srli_epi16(v, 8);
+			__m128i *p0 = (__m128i*)(row0 + x * 4), *p1 = (__m128i*)(row1 + x * 4);
+#define MERGE(p, v) _mm_storeu_si128(p, _mm_or_si128(_mm_loadu_si128(p), _mm_sll_epi32(v, shift)))
+			MERGE(p0,     _mm_unpacklo_epi16(v0, zero));
+			MERGE(p0 + 1, _mm_unpackhi_epi16(v0, zero));
+			MERGE(p1,     _mm_unpacklo_epi16(v1, zero));
+			MERGE(p1 + 1, _mm_unpackhi_epi16(v1, zero));
+#undef MERGE
 		}
-		if (y != h) {
-			for (x = 0; x < (w -1); x+=2) {
-				pic[(y*w+x  )*3+i] = raw[j];
-				pic[(y*w+x+1)*3+i] = raw[j+2];
-				j+=4;
+	}
+	merge_band_from(rgba, stride, plane, c, w, h, y, x);
+}
+
+// per-byte (a + b) >> 1 (_mm_avg_epu8 rounds up)
+static inline __m128i avg_floor_sse2(__m128i a, __m128i b)
+{
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static void predict_rows_sse2(uint32_t *rgba, size_t stride, int w, int y, uint32_t fill)
+{
+	WAVEFRONT_BEGIN(4);
+	const __m128i vfill = _mm_set1_epi32(fill);
+	__m128i prev = _mm_setr_epi32(r[0][3], r[1][2], r[2][1], r[3][0]);
+	for (int t = 4; t < w; t++) {
+		__m128i vup = _mm_or_si128(_mm_slli_si128(prev, 4), _mm_cvtsi32_si128(up[t]));
+		__m128i d = _mm_setr_epi32(r[0][t], r[1][t-1], r[2][t-2], r[3][t-3]);
+		prev = _mm_or_si128(_mm_sub_epi8(avg_floor_sse2(vup, prev), d), vfill);
+		r[0][t]   = _mm_cvtsi128_si32(prev);
+		r[1][t-1] = _mm_cvtsi128_si32(_mm_srli_si128(prev, 4));
+		r[2][t-2] = _mm_cvtsi128_si32(_mm_srli_si128(prev, 8));
+		r[3][t-3] = _mm_cvtsi128_si32(_mm_srli_si128(prev, 12));
+	}
+	WAVEFRONT_END(4);
+}
+
+static const struct qnt_kernels qnt_kernels_sse2 = {
+	.unpack_band = unpack_band_sse2,
+	.merge_band = merge_band_sse2,
+	.predict_rows = predict_rows_sse2,
+	.rows = 4,
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_QNT_AVX2
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static void unpack_band_avx2(uint8_t *rgba, size_t stride, const uint8_t *plane, const uint8_t *alpha,
+		int c, int w, int h, int y)
+{
+	int x = 0;
+	if (y + 1 < h) {
+		int pw = (w + 1) & ~1;
+		uint8_t *row0 = rgba + y * stride;
+		uint8_t *row1 = row0 + stride;
+		const __m256i mask = _mm256_set1_epi16(0xff), zero = _mm256_setzero_si256();
+		__m256i a = zero;
+		for (; x + 16 <= w; x += 16) {
+			// each 128-bit lane holds 8 pixels of row y and 8 pixels of row y+1
+			__m256i b = _mm256_loadu_si256((const __m256i*)(plane + x * 2));
+			b = _mm256_packus_epi16(_mm256_and_si256(b, mask), _mm256_srli_epi16(b, 8));
+			if (alpha) {
+				__m128i a0 = _mm_loadu_si128((const __m128i*)(alpha + x));
+				__m128i a1 = _mm_loadu_si128((const __m128i*)(alpha + pw + x));
+				a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi64(a0, a1)),
+							    _mm_unpackhi_epi64(a0, a1), 1);
 			}
-			if (x != w) {
-				pic[( y   *w+x)*3 +i] = raw[j];
-				j+=4;
+			// the low and high 16 bits of each pixel of rows y and y+1
+			__m256i l0 = zero, l1 = zero, h0, h1;
+			if (c == 2) {
+				h0 = _mm256_unpacklo_epi8(b, a);
+				h1 = _mm256_unpackhi_epi8(b, a);
+			} else {
+				l0 = _mm256_unpacklo_epi8(b, zero);
+				l1 = _mm256_unpackhi_epi8(b, zero);
+				h0 = _mm256_unpacklo_epi8(zero, a);
+				h1 = _mm256_unpackhi_epi8(zero, a);
 			}
+			__m256i lo0 = _mm256_unpacklo_epi16(l0, h0), hi0 = _mm256_unpackhi_epi16(l0, h0);
+			__m256i lo1 = _mm256_unpacklo_epi16(l1, h1), hi1 = _mm256_unpackhi_epi16(l1, h1);
+			__m256i *p0 = (__m256i*)(row0 + x * 4), *p1 = (__m256i*)(row1 + x * 4);
+			_mm256_storeu_si256(p0,     _mm256_permute2x128_si256(lo0, hi0, 0x20));
+			_mm256_storeu_si256(p0 + 1, _mm256_permute2x128_si256(lo0, hi0, 0x31));
+			_mm256_storeu_si256(p1,     _mm256_permute2x128_si256(lo1, hi1, 0x20));
+			_mm256_storeu_si256(p1 + 1, _mm256_permute2x128_si256(lo1, hi1, 0x31));
 		}
 	}
+	unpack_band_from(rgba, stride, plane, alpha, c, w, h, y, x);
+}
 
-	if (w > 1) {
-		for (x = 1; x < w; x++) {
-			pic[x*3  ] = pic[(x-1)*3  ] - pic[x*3  ];
-			pic[x*3+1] = pic[(x-1)*3+1] - pic[x*3+1];
-			pic[x*3+2] = pic[(x-1)*3+2] - pic[x*3+2];
+__attribute__((target("avx2")))
+static void merge_band_avx2(uint8_t *rgba, size_t stride, const uint8_t *plane, int c, int w, int h, int y)
+{
+	int x = 0;
+	if (y + 1 < h) {
+		uint8_t *row0 = rgba + y * stride;
+		uint8_t *row1 = row0 + stride;
+		const __m256i mask = _mm256_set1_epi16(0xff), zero = _mm256_setzero_si256();
+		const __m128i shift = _mm_cvtsi32_si128(c * 8);
+		for (; x + 16 <= w; x += 16) {
+			__m256i v = _mm256_loadu_si256((const __m256i*)(plane + x * 2));
+			__m256i v0 = _mm256_and_si256(v, mask), v1 = _mm256_srli_epi16(v, 8);
+			__m256i lo0 = _mm256_unpacklo_epi16(v0, zero), hi0 = _mm256_unpackhi_epi16(v0, zero);
+			__m256i lo1 = _mm256_unpacklo_epi16(v1, zero), hi1 = _mm256_unpackhi_epi16(v1, zero);
+			__m256i *p0 = (__m256i*)(row0 + x * 4), *p1 = (__m256i*)(row1 + x * 4);
+#define MERGE(p, v) _mm256_storeu_si256(p, _mm256_or_si256(_mm256_loadu_si256(p), _mm256_sll_epi32(v, shift)))
+			MERGE(p0,     _mm256_permute2x128_si256(lo0, hi0, 0x20));
+			MERGE(p0 + 1, _mm256_permute2x128_si256(lo0, hi0, 0x31));
+			MERGE(p1,     _mm256_permute2x128_si256(lo1, hi1, 0x20));
+			MERGE(p1 + 1, _mm256_permute2x128_si256(lo1, hi1, 0x31));
+#undef MERGE
 		}
 	}
+	merge_band_from(rgba, stride, plane, c, w, h, y, x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avg_floor_avx2(__m256i a, __m256i b)
+{
+	return _mm256_sub_epi8(_mm256_avg_epu8(a, b),
+			_mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+}
 
-	if (h > 1) {
-		for (y = 1; y < h; y++) {
-			pic[(y*w)*3  ] = pic[((y-1)*w)*3  ] - pic[(y*w)*3  ];
-			pic[(y*w)*3+1] = pic[((y-1)*w)*3+1] - pic[(y*w)*3+1];
-			pic[(y*w)*3+2] = pic[((y-1)*w)*3+2] - pic[(y*w)*3+2];
-
-			for (x = 1; x < w; x++) {
-				int px, py;
-				py = pic[((y-1)*w+x  )*3];
-				px = pic[( y   *w+x-1)*3];
-				pic[(y*w+x)*3] = ((py+px)>>1) - pic[(y*w+x)*3];
-				py = pic[((y-1)*w+x  )*3+1];
-				px = pic[( y   *w+x-1)*3+1];
-				pic[(y*w+x)*3+1] = ((py+px)>>1) - pic[(y*w+x)*3+1];
-				py = pic[((y-1)*w+x  )*3+2];
-				px = pic[( y   *w+x-1)*3+2];
-				pic[(y*w+x)*3+2] = ((py+px)>>1) - pic[(y*w+x)*3+2];
+__attribute__((target("avx2")))
+static void predict_rows_avx2(uint32_t *rgba, size_t stride, int w, int y, uint32_t fill)
+{
+	WAVEFRONT_BEGIN(8);
+	const __m256i vfill = _mm256_set1_epi32(fill);
+	// offsets of the pixels (t-i, y+i) from (t, y)
+	const __m256i diag = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+			_mm256_set1_epi32(pitch - 1));
+	__m256i prev = _mm256_setr_epi32(r[0][7], r[1][6], r[2][5], r[3][4],
+			r[4][3], r[5][2], r[6][1], r[7][0]);
+	for (int t = 8; t < w; t++) {
+		// shift the lanes up by one, across the 128-bit halves
+		__m256i vup = _mm256_alignr_epi8(prev, _mm256_permute2x128_si256(prev, prev, 0x08), 12);
+		vup = _mm256_or_si256(vup, _mm256_setr_epi32(up[t], 0, 0, 0, 0, 0, 0, 0));
+		__m256i d = _mm256_i32gather_epi32((const int*)(r[0] + t), diag, 4);
+		prev = _mm256_or_si256(_mm256_sub_epi8(avg_floor_avx2(vup, prev), d), vfill);
+		__m128i lo = _mm256_castsi256_si128(prev), hi = _mm256_extracti128_si256(prev, 1);
+		r[0][t]   = _mm_cvtsi128_si32(lo);
+		r[1][t-1] = _mm_extract_epi32(lo, 1);
+		r[2][t-2] = _mm_extract_epi32(lo, 2);
+		r[3][t-3] = _mm_extract_epi32(lo, 3);
+		r[4][t-4] = _mm_cvtsi128_si32(hi);
+		r[5][t-5] = _mm_extract_epi32(hi, 1);
+		r[6][t-6] = _mm_extract_epi32(hi, 2);
+		r[7][t-7] = _mm_extract_epi32(hi, 3);
+	}
+	WAVEFRONT_END(8);
+}
+
+static const struct qnt_kernels qnt_kernels_avx2 = {
+	.unpack_band = unpack_band_avx2,
+	.merge_band = merge_band_avx2,
+	.predict_rows = predict_rows_avx2,
+	.rows = 8,
+};
+#endif // __GNUC__ && (__x86_64__ || __i386__)
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static void unpack_band_neon(uint8_t *rgba, size_t stride, const uint8_t *plane, const uint8_t *alpha,
+		int c, int w, int h, int y)
+{
+	int x = 0;
+	if (y + 1 < h) {
+		int pw = (w + 1) & ~1;
+		uint8_t *row0 = rgba + y * stride;
+		uint8_t *row1 = row0 + stride;
+		uint8x8x4_t p0, p1;
+		p0.val[0] = p0.val[1] = p0.val[2] = p0.val[3] = vdup_n_u8(0);
+		p1.val[0] = p1.val[1] = p1.val[2] = p1.val[3] = vdup_n_u8(0);
+		for (; x + 8 <= w; x += 8) {
+			// vld2 splits the even bytes (row y) from the odd bytes (row y+1)
+			uint8x8x2_t b = vld2_u8(plane + x * 2);
+			p0.val[c] = b.val[0];
+			p1.val[c] = b.val[1];
+			if (alpha) {
+				p0.val[3] = vld1_u8(alpha + x);
+				p1.val[3] = vld1_u8(alpha + pw + x);
 			}
+			vst4_u8(row0 + x * 4, p0);
+			vst4_u8(row1 + x * 4, p1);
 		}
 	}
+	unpack_band_from(rgba, stride, plane, alpha, c, w, h, y, x);
+}
 
-	free(raw);
+static void merge_band_neon(uint8_t *rgba, size_t stride, const uint8_t *plane, int c, int w, int h, int y)
+{
+	int x = 0;
+	if (y + 1 < h) {
+		uint8_t *row0 = rgba + y * stride;
+		uint8_t *row1 = row0 + stride;
+		for (; x + 8 <= w; x += 8) {
+			uint8x8x2_t v = vld2_u8(plane + x * 2);
+			uint8x8x4_t p0 = vld4_u8(row0 + x * 4);
+			uint8x8x4_t p1 = vld4_u8(row1 + x * 4);
+			p0.val[c] = v.val[0];
+			p1.val[c] = v.val[1];
+			vst4_u8(row0 + x * 4, p0);
+			vst4_u8(row1 + x * 4, p1);
+		}
+	}
+	merge_band_from(rgba, stride, plane, c, w, h, y, x);
+}
+
+static void predict_rows_neon(uint32_t *rgba, size_t stride, int w, int y, uint32_t fill)
+{
+	WAVEFRONT_BEGIN(4);
+	const uint8x16_t vfill = vreinterpretq_u8_u32(vdupq_n_u32(fill));
+	uint32_t init[4] = { r[0][3], r[1][2], r[2][1], r[3][0] };
+	uint8x16_t prev = vreinterpretq_u8_u32(vld1q_u32(init));
+	for (int t = 4; t < w; t++) {
+		uint8x16_t vup = vextq_u8(vreinterpretq_u8_u32(vdupq_n_u32(up[t])), prev, 12);
+		uint32x4_t d = vdupq_n_u32(r[0][t]);
+		d = vsetq_lane_u32(r[1][t-1], d, 1);
+		d = vsetq_lane_u32(r[2][t-2], d, 2);
+		d = vsetq_lane_u32(r[3][t-3], d, 3);
+		// vhaddq_u8 is (a + b) >> 1 without overflow
+		prev = vorrq_u8(vsubq_u8(vhaddq_u8(vup, prev), vreinterpretq_u8_u32(d)), vfill);
+		uint32x4_t p = vreinterpretq_u32_u8(prev);
+		vst1q_lane_u32(&r[0][t],   p, 0);
+		vst1q_lane_u32(&r[1][t-1], p, 1);
+		vst1q_lane_u32(&r[2][t-2], p, 2);
+		vst1q_lane_u32(&r[3][t-3], p, 3);
+	}
+	WAVEFRONT_END(4);
+}
+
+static const struct qnt_kernels qnt_kernels_neon = {
+	.unpack_band = unpack_band_neon,
+	.merge_band = merge_band_neon,
+	.predict_rows = predict_rows_neon,
+	.rows = 4,
+};
+#endif // __ARM_NEON
+
+static const struct qnt_kernels *qnt_get_kernels(void)
+{
+#ifdef HAVE_QNT_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return &qnt_kernels_avx2;
+#endif
+#if defined(__SSE2__)
+	return &qnt_kernels_sse2;
+#elif defined(__ARM_NEON)
+	return &qnt_kernels_neon;
+#else
+	return &qnt_kernels_scalar;
+#endif
 }
 
 /*
- * Do extract qnt alpha image
+ * Decode the pixel and alpha planes of a QNT image into `rgba`.
  *
  *   qnt: qnt header information
- *   pic: pixel to be stored
- *   b  : raw data (pointer to alpha pixel)
+ *   rgba: destination (height rows of `stride` bytes, 4-byte aligned)
+ *   stride: distance between rows in bytes (a multiple of 4)
+ *   b  : raw data (pointer to pixel data)
+ *   bgr: store pixels in BGRA order instead
+ *   stats: alpha statistics, added to as rows are completed (or NULL)
  */
-static void extract_alpha(struct qnt_header *qnt, uint8_t *pic, const uint8_t *b)
+static void qnt_decode(struct qnt_header *qnt, uint8_t *rgba, size_t stride, const uint8_t *b,
+		bool bgr, struct pixel_alpha_stats *stats)
 {
-	int i, x, y, w, h;
-	unsigned long ucbuf = (qnt->width+1) * (qnt->height+1) + ZLIBBUF_MARGIN;
-	uint8_t *raw = malloc(sizeof(uint8_t) * ucbuf);
-
-	if (Z_OK != uncompress(raw, &ucbuf, b, qnt->alpha_size)) {
-		WARNING("uncompress failed\n");
-		free(raw);
+	const struct qnt_kernels *k = qnt_get_kernels();
+	int w = qnt->width;
+	int h = qnt->height;
+	int pw = (w + 1) & ~1;
+	int ph = (h + 1) & ~1;
+	if (!w || !h)
 		return;
-	}
+	// rows per chunk (a multiple of the two-row band)
+	int chunk_rows = max(QNT_CHUNK_SIZE / pw & ~1, 2);
+	size_t chunk_size = (size_t)pw * chunk_rows;
+	struct cg_decoder_ctx *ctx = cg_decoder_ctx_get();
+	uint8_t *chunk = cg_decoder_scratch(ctx, chunk_size * 2);
+	uint8_t *alpha_chunk = chunk + chunk_size;
 
-	w = qnt->width;
-	h = qnt->height;
+	struct plane_reader pixel, alpha;
+	plane_reader_init(&pixel, ctx, 0, b, qnt->pixel_size);
+	if (qnt->alpha_size)
+		plane_reader_init(&alpha, ctx, 1, b + qnt->pixel_size, qnt->alpha_size);
 
-	i = 1;
-	if (w > 1) {
-		pic[0] = raw[0];
-		for (x = 1; x < w; x++) {
-			pic[x] = pic[x-1] - raw[i];
-			i++;
+	// B and alpha planes
+	for (int y = 0; y < h; y += chunk_rows) {
+		int n = min(chunk_rows, ph - y);
+		plane_reader_read(&pixel, chunk, (size_t)pw * n);
+		if (qnt->alpha_size)
+			plane_reader_read(&alpha, alpha_chunk, (size_t)pw * n);
+		for (int i = 0; i < n; i += 2) {
+			k->unpack_band(rgba, stride, chunk + (size_t)i * pw,
+					qnt->alpha_size ? alpha_chunk + (size_t)i * pw : NULL,
+					bgr ? 0 : 2, w, h, y + i);
 		}
-		if (w%2) i++;
-	}
-
-	if (h > 1) {
-		for (y = 1; y < h; y++) {
-			pic[y*w] = pic[(y-1) *w] - raw[i]; i++;
-			for (x = 1; x < w; x++) {
-				int pax, pay;
-				pax = pic[ y   * w + x -1];
-				pay = pic[(y-1)* w + x   ];
-				pic[y*w+x] = ((pax+pay) >> 1) - raw[i];
-				i++;
+	}
+	// FIXME: Some CGs don't display correctly unless we add an alpha channel here.
+	//        Not sure why. It seems to affect some but not all alpha-less CGs.
+	//        E.g. CG#90 (and similar) from the Rance 2 digest version.
+	uint32_t fill = 0;
+	if (!qnt->alpha_size || !plane_reader_end(&alpha))
+		memcpy(&fill, (uint8_t[4]){0, 0, 0, 0xff}, 4);
+
+	// G plane
+	for (int y = 0; y < h; y += chunk_rows) {
+		int n = min(chunk_rows, ph - y);
+		plane_reader_read(&pixel, chunk, (size_t)pw * n);
+		for (int i = 0; i < n; i += 2)
+			k->merge_band(rgba, stride, chunk + (size_t)i * pw, 1, w, h, y + i);
+	}
+
+	// R plane, undoing the delta coding of each row once it is complete
+	int done = 0; // rows [0, done) are fully decoded
+	int scanned = 0; // rows [0, scanned) are added to `stats`
+	for (int y = 0; y < h; y += chunk_rows) {
+		int n = min(chunk_rows, ph - y);
+		plane_reader_read(&pixel, chunk, (size_t)pw * n);
+		for (int i = 0; i < n; i += 2) {
+			k->merge_band(rgba, stride, chunk + (size_t)i * pw, bgr ? 2 : 0, w, h, y + i);
+			if (!done) {
+				predict_row((uint32_t*)rgba, NULL, w, fill);
+				done = 1;
 			}
-			if (w%2) i++;
+			for (; done + k->rows <= min(y + i + 2, h); done += k->rows)
+				k->predict_rows((uint32_t*)rgba, stride, w, done, fill);
+			for (; stats && scanned < done; scanned++)
+				pixel_alpha_stats_add(stats, rgba + scanned * stride + 3, 4, w);
 		}
 	}
+	for (; done < h; done++)
+		predict_rows((uint32_t*)rgba, stride, w, done, fill);
+	for (; stats && scanned < done; scanned++)
+		pixel_alpha_stats_add(stats, rgba + scanned * stride + 3, 4, w);
 
-	free(raw);
+	plane_reader_end(&pixel);
 }
 
 /*
@@ -250,31 +749,43 @@ void qnt_extract(const uint8_t *data, struct cg *cg)
 	qnt_extract_header(data, &qnt);
 	qnt_init_metrics(&qnt, &cg->metrics);
 
-	uint8_t *pixels = xcalloc(3, (qnt.width+10) * (qnt.height+10));
-	extract_pixel(&qnt, pixels, data + qnt.hdr_size);
+	if (qnt.width < 0 || qnt.height < 0) {
+		WARNING("Invalid QNT dimensions: %dx%d", qnt.width, qnt.height);
+		return;
+	}
 
 	cg->type = ALCG_QNT;
-
-	// combine color/alpha data
-	uint8_t *alpha = xmalloc((qnt.width+10) * (qnt.height+10));
-	uint8_t *tmp = xmalloc((qnt.width+10) * (qnt.height+10) * 4);
-	if (qnt.alpha_size) {
-		extract_alpha(&qnt, alpha, data + qnt.hdr_size + qnt.pixel_size);
-	} else {
-		// FIXME: Some CGs don't display correctly unless we add an alpha channel here.
-		//        Not sure why. It seems to affect some but not all alpha-less CGs.
-		//        E.g. CG#90 (and similar) from the Rance 2 digest version.
-		memset(alpha, 0xFF, (qnt.width+10)*(qnt.height+10));
+	cg->pixels = xmalloc(max((size_t)qnt.width * qnt.height, (size_t)1) * 4);
+	if (!qnt.alpha_size) {
+		qnt_decode(&qnt, cg->pixels, qnt.width * 4, data + qnt.hdr_size, false, NULL);
+		cg_set_opaque(cg);
+		return;
 	}
-	for (int src_i = 0, dst_i = 0, p = 0; p < qnt.width * qnt.height; p++) {
-		tmp[dst_i++] = pixels[src_i++];
-		tmp[dst_i++] = pixels[src_i++];
-		tmp[dst_i++] = pixels[src_i++];
-		tmp[dst_i++] = alpha[p];
+	struct pixel_alpha_stats stats, *s = cg_alpha_stats_begin(&stats, qnt.width);
+	qnt_decode(&qnt, cg->pixels, qnt.width * 4, data + qnt.hdr_size, false, s);
+	cg_alpha_stats_end(cg, s);
+}
+
+/*
+ * Extract qnt pixels into a caller-provided RGBA (or BGRA) buffer
+ *
+ *   data: raw data (pointer to data top)
+ *   dst: destination (height rows of `stride` bytes, 4-byte aligned)
+ *   stride: distance between rows in bytes (a multiple of 4)
+ *   bgr: store pixels in BGRA order
+ *
+ *   return: true on success
+ */
+bool qnt_extract_into(const uint8_t *data, uint8_t *dst, size_t stride, bool bgr)
+{
+	struct qnt_header qnt;
+	qnt_extract_header(data, &qnt);
+	if (qnt.width < 0 || qnt.height < 0) {
+		WARNING("Invalid QNT dimensions: %dx%d", qnt.width, qnt.height);
+		return false;
 	}
-	free(alpha);
-	free(pixels);
-	cg->pixels = tmp;
+	qnt_decode(&qnt, dst, stride, data + qnt.hdr_size, bgr, NULL);
+	return true;
 }
 
 /*
@@ -282,38 +793,28 @@ void qnt_extract(const uint8_t *data, struct cg *cg)
  * (github.com/kichikuou/xsys35c)
  */
 
-static void fputdw(uint32_t n, FILE *fp) {
-	fputc(n, fp);
-	fputc(n >> 8, fp);
-	fputc(n >> 16, fp);
-	fputc(n >> 24, fp);
-}
-
-static void qnt_write_header(struct qnt_header *qnt, FILE *fp) {
-	fputc('Q', fp);
-	fputc('N', fp);
-	fputc('T', fp);
-	fputc('\0', fp);
-	fputdw(1, fp);
-	fputdw(qnt->hdr_size, fp);
-	fputdw(qnt->x0, fp);
-	fputdw(qnt->y0, fp);
-	fputdw(qnt->width, fp);
-	fputdw(qnt->height, fp);
-	fputdw(qnt->bpp, fp);
-	fputdw(qnt->rsv, fp);
-	fputdw(qnt->pixel_size, fp);
-	fputdw(qnt->alpha_size, fp);
+static void qnt_write_header(struct qnt_header *qnt, struct buffer *out) {
+	buffer_write_bytes(out, (const uint8_t*)"QNT", 4);
+	buffer_write_int32(out, 1);
+	buffer_write_int32(out, qnt->hdr_size);
+	buffer_write_int32(out, qnt->x0);
+	buffer_write_int32(out, qnt->y0);
+	buffer_write_int32(out, qnt->width);
+	buffer_write_int32(out, qnt->height);
+	buffer_write_int32(out, qnt->bpp);
+	buffer_write_int32(out, qnt->rsv);
+	buffer_write_int32(out, qnt->pixel_size);
+	buffer_write_int32(out, qnt->alpha_size);
 	for (int i = 44; i < qnt->hdr_size; i++)
-		fputc(0, fp);
+		buffer_write_int8(out, 0);
 }
 
-static uint8_t *encode_pixels(struct qnt_header *qnt, uint8_t **rows) {
+static uint8_t *pack_pixels(struct qnt_header *qnt, uint8_t **rows, size_t *size_out) {
 	int width = (qnt->width + 1) & ~1;
 	int height = (qnt->height + 1) & ~1;
 
-	const int bufsize = width * height * 3;
-	uint8_t *buf = malloc(bufsize);
+	const size_t bufsize = (size_t)width * height * 3;
+	uint8_t *buf = xmalloc(max(bufsize, (size_t)1));
 	uint8_t *p = buf;
 	for (int c = 2; c >= 0; c--) {
 		for (int y = 0; y < height; y += 2) {
@@ -326,46 +827,212 @@ static uint8_t *encode_pixels(struct qnt_header *qnt, uint8_t **rows) {
 		}
 	}
 	assert(p == buf + bufsize);
-
-	unsigned long destsize = compressBound(bufsize);
-	uint8_t *compressed = malloc(destsize);
-	int r = compress2(compressed, &destsize, buf, bufsize, Z_BEST_COMPRESSION);
-	if (r != Z_OK) {
-		WARNING("qnt: compress() failed with error code %d", r);
-		free(buf);
-		free(compressed);
-		return NULL;
-	}
-	qnt->pixel_size = destsize;
-
-	free(buf);
-	return compressed;
+	*size_out = bufsize;
+	return buf;
 }
 
-static uint8_t *encode_alpha(struct qnt_header *qnt, uint8_t **rows) {
+static uint8_t *pack_alpha(struct qnt_header *qnt, uint8_t **rows, size_t *size_out) {
 	int width = (qnt->width + 1) & ~1;
 	int height = (qnt->height + 1) & ~1;
 
-	const int bufsize = width * height;
-	uint8_t *buf = malloc(bufsize);
+	const size_t bufsize = (size_t)width * height;
+	uint8_t *buf = xmalloc(max(bufsize, (size_t)1));
 	for (int y = 0; y < height; y++) {
 		for (int x = 0; x < width; x++)
-			buf[y * width + x] = rows[y][x * 4 + 3];
+			buf[(size_t)y * width + x] = rows[y][x * 4 + 3];
 	}
+	*size_out = bufsize;
+	return buf;
+}
 
-	unsigned long destsize = compressBound(bufsize);
-	uint8_t *compressed = malloc(destsize);
-	int r = compress2(compressed, &destsize, buf, bufsize, Z_BEST_COMPRESSION);
-	if (r != Z_OK) {
-		WARNING("qnt: compress() failed with error code %d", r);
-		free(buf);
-		free(compressed);
-		return NULL;
+/*
+ * Parallel deflate
+ *
+ * With more than one thread, each plane is cut into blocks which are
+ * compressed independently (and concurrently with the blocks of the other
+ * plane) as raw deflate data, primed with the last 32KB of the preceding
+ * block. Every block but the last of a plane ends with a sync flush, so that
+ * it ends on a byte boundary, and the blocks are simply concatenated between
+ * a zlib header and the Adler-32 of the whole plane. This is the same scheme
+ * as pigz; the result is a single ordinary zlib stream, slightly larger than
+ * what a single deflate pass would produce.
+ */
+
+#define QNT_DEFLATE_BLOCK_SIZE (128 * 1024)
+#define QNT_DEFLATE_DICT_SIZE (32 * 1024)
+
+struct deflate_job {
+	const uint8_t *in;
+	size_t in_size;
+	size_t dict_size; // bytes preceding `in` to prime the window with
+	bool last;
+	uint8_t *out;
+	size_t out_size;
+	uint32_t adler;
+	bool ok;
+};
+
+struct deflate_state {
+	struct deflate_job *jobs;
+	size_t nr_jobs;
+	atomic_size_t next;
+	int level;
+	int strategy;
+};
+
+static void deflate_block(struct deflate_job *job, int level, int strategy)
+{
+	z_stream z = {0};
+	job->ok = false;
+	job->adler = adler32(1, job->in, job->in_size);
+	if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+		WARNING("qnt: deflateInit2() failed");
+		return;
+	}
+	if (job->dict_size)
+		deflateSetDictionary(&z, job->in - job->dict_size, job->dict_size);
+
+	// room for the sync flush marker on top of deflateBound()
+	size_t bound = deflateBound(&z, job->in_size) + 16;
+	job->out = xmalloc(bound);
+	z.next_in = (Bytef*)job->in;
+	z.avail_in = job->in_size;
+	z.next_out = job->out;
+	z.avail_out = bound;
+	int r = deflate(&z, job->last ? Z_FINISH : Z_SYNC_FLUSH);
+	if (r != (job->last ? Z_STREAM_END : Z_OK) || z.avail_in || !z.avail_out) {
+		WARNING("qnt: deflate() failed with error code %d", r);
+	} else {
+		job->out_size = bound - z.avail_out;
+		job->ok = true;
 	}
-	qnt->alpha_size = destsize;
+	deflateEnd(&z);
+}
 
-	free(buf);
-	return compressed;
+static void *deflate_worker(void *_state)
+{
+	struct deflate_state *state = _state;
+	size_t i;
+	while ((i = atomic_fetch_add(&state->next, 1)) < state->nr_jobs)
+		deflate_block(&state->jobs[i], state->level, state->strategy);
+	return NULL;
+}
+
+static uint8_t zlib_flevel(int level, int strategy)
+{
+	// same as deflate's zlib header
+	if (strategy >= Z_HUFFMAN_ONLY || level < 2)
+		return 0;
+	if (level < 6)
+		return 1;
+	if (level == 6 || level == Z_DEFAULT_COMPRESSION)
+		return 2;
+	return 3;
+}
+
+/*
+ * Compress `nr_planes` buffers into separate zlib streams, using up to
+ * `opts->nr_threads` threads. The compressed streams are returned in `out`
+ * (and their sizes in `out_size`).
+ */
+static bool compress_planes(const uint8_t **in, const size_t *in_size, int nr_planes,
+		uint8_t **out, size_t *out_size, const struct qnt_write_options *opts)
+{
+	if (opts->nr_threads <= 1) {
+		bool ok = true;
+		for (int i = 0; i < nr_planes; i++) {
+			z_stream z = {0};
+			out[i] = NULL;
+			if (!ok)
+				continue;
+			if (deflateInit2(&z, opts->level, Z_DEFLATED, 15, 8, opts->strategy) != Z_OK) {
+				WARNING("qnt: deflateInit2() failed");
+				ok = false;
+				continue;
+			}
+			size_t bound = deflateBound(&z, in_size[i]);
+			out[i] = xmalloc(bound);
+			z.next_in = (Bytef*)in[i];
+			z.avail_in = in_size[i];
+			z.next_out = out[i];
+			z.avail_out = bound;
+			int r = deflate(&z, Z_FINISH);
+			if (r != Z_STREAM_END) {
+				WARNING("qnt: deflate() failed with error code %d", r);
+				ok = false;
+			}
+			out_size[i] = z.total_out;
+			deflateEnd(&z);
+		}
+		return ok;
+	}
+
+	struct deflate_state state = { .level = opts->level, .strategy = opts->strategy };
+	atomic_init(&state.next, 0);
+	for (int i = 0; i < nr_planes; i++)
+		state.nr_jobs += max((in_size[i] + QNT_DEFLATE_BLOCK_SIZE - 1) / QNT_DEFLATE_BLOCK_SIZE, (size_t)1);
+	state.jobs = xcalloc(state.nr_jobs, sizeof(struct deflate_job));
+	struct deflate_job *job = state.jobs;
+	for (int i = 0; i < nr_planes; i++) {
+		size_t off = 0;
+		do {
+			job->in = in[i] + off;
+			job->in_size = min(in_size[i] - off, (size_t)QNT_DEFLATE_BLOCK_SIZE);
+			job->dict_size = min(off, (size_t)QNT_DEFLATE_DICT_SIZE);
+			off += job->in_size;
+			job->last = off == in_size[i];
+			job++;
+		} while (off < in_size[i]);
+	}
+
+	// the calling thread acts as one of the workers
+	int nr_workers = min((size_t)opts->nr_threads, state.nr_jobs) - 1;
+	pthread_t *workers = xcalloc(max(nr_workers, 1), sizeof(pthread_t));
+	int nr_started = 0;
+	for (; nr_started < nr_workers; nr_started++) {
+		if (pthread_create(&workers[nr_started], NULL, deflate_worker, &state)) {
+			WARNING("pthread_create failed");
+			break;
+		}
+	}
+	deflate_worker(&state);
+	for (int i = 0; i < nr_started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	free(workers);
+
+	// stitch the blocks of each plane together
+	bool ok = true;
+	job = state.jobs;
+	for (int i = 0; i < nr_planes; i++) {
+		struct deflate_job *first = job;
+		size_t size = 2 + 4;
+		uint32_t adler = 1;
+		do {
+			ok = ok && job->ok;
+			size += job->out_size;
+			adler = adler32_combine(adler, job->adler, job->in_size);
+		} while (!(job++)->last);
+
+		uint8_t *p = out[i] = xmalloc(size);
+		uint16_t header = 0x7800 | zlib_flevel(opts->level, opts->strategy) << 6;
+		header += 31 - header % 31;
+		*p++ = header >> 8;
+		*p++ = header;
+		for (struct deflate_job *j = first; j < job; j++) {
+			if (j->ok)
+				memcpy(p, j->out, j->out_size);
+			p += j->out_size;
+			free(j->out);
+		}
+		*p++ = adler >> 24;
+		*p++ = adler >> 16;
+		*p++ = adler >> 8;
+		*p++ = adler;
+		out_size[i] = size;
+	}
+	free(state.jobs);
+	return ok;
 }
 
 static void filter(uint8_t **rows, int width, int height) {
@@ -390,9 +1057,9 @@ static void filter(uint8_t **rows, int width, int height) {
 static uint8_t **allocate_bitmap_buffer(int width, int height)
 {
 	uint8_t **rows = xmalloc(sizeof(uint8_t*)*height);
-	uint8_t *buffer = calloc(1, height * width * 4);
+	uint8_t *buffer = xcalloc((size_t)height * width, 4);
 	for (int y = 0; y < height; y++) {
-		rows[y] = buffer + y * width * 4;
+		rows[y] = buffer + (size_t)y * width * 4;
 	}
 	return rows;
 }
@@ -403,8 +1070,12 @@ static void free_bitmap_buffer(uint8_t **rows)
 	free(rows);
 }
 
-int qnt_write(struct cg *cg, FILE *f)
+int qnt_encode(struct cg *cg, const struct qnt_write_options *opts, struct buffer *out)
 {
+	static const struct qnt_write_options default_opts = QNT_WRITE_OPTIONS_DEFAULT;
+	if (!opts)
+		opts = &default_opts;
+
 	struct qnt_header qnt = {
 		.hdr_size = 52,
 		.width = cg->metrics.w,
@@ -420,19 +1091,47 @@ int qnt_write(struct cg *cg, FILE *f)
 	}
 
 	filter(rows, cg->metrics.w, cg->metrics.h);
-	uint8_t *pixel_data = encode_pixels(&qnt, rows);
-	uint8_t *alpha_data = encode_alpha(&qnt, rows);
-	if (!pixel_data || !alpha_data) {
-		free(pixel_data);
-		free(alpha_data);
+	const uint8_t *planes[2];
+	size_t plane_size[2];
+	planes[0] = pack_pixels(&qnt, rows, &plane_size[0]);
+	planes[1] = pack_alpha(&qnt, rows, &plane_size[1]);
+	free_bitmap_buffer(rows);
+
+	uint8_t *data[2];
+	size_t data_size[2];
+	bool ok = compress_planes(planes, plane_size, 2, data, data_size, opts);
+	free((uint8_t*)planes[0]);
+	free((uint8_t*)planes[1]);
+	if (!ok) {
+		free(data[0]);
+		free(data[1]);
 		return 0;
 	}
+	qnt.pixel_size = data_size[0];
+	qnt.alpha_size = data_size[1];
 
-	qnt_write_header(&qnt, f);
-	fwrite(pixel_data, qnt.pixel_size, 1, f);
-	free(pixel_data);
-	fwrite(alpha_data, qnt.alpha_size, 1, f);
-	free(alpha_data);
-	free_bitmap_buffer(rows);
+	qnt_write_header(&qnt, out);
+	buffer_write_bytes(out, data[0], qnt.pixel_size);
+	free(data[0]);
+	buffer_write_bytes(out, data[1], qnt.alpha_size);
+	free(data[1]);
 	return 1;
 }
+
+int qnt_write_with_options(struct cg *cg, FILE *f, const struct qnt_write_options *opts)
+{
+	struct buffer out;
+	buffer_init(&out, NULL, 0);
+	int r = qnt_encode(cg, opts, &out);
+	if (r && fwrite(out.buf, out.index, 1, f) != 1) {
+		WARNING("qnt_write: %s", strerror(errno));
+		r = 0;
+	}
+	free(out.buf);
+	return r;
+}
+
+int qnt_write(struct cg *cg, FILE *f)
+{
+	return qnt_write_with_options(cg, f, NULL);
+}
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "system4/utfsjis.h"
 #include "system4/s2utbl.h"
@@ -97,16 +98,29 @@ char *sjis2utf(const char *_src, size_t len) {
 	return (char*)dst;
 }
 
-static int unicode_to_sjis(int u) {
+// Reverse lookup table for unicode_to_sjis, indexed by BMP code point.
+// Built once, on first use.
+static uint16_t u2s[0x10000];
+static pthread_once_t u2s_once = PTHREAD_ONCE_INIT;
+
+static void u2s_init(void)
+{
 	for (int b1 = 0x81; b1 <= 0xff; b1++) {
 		if (b1 >= 0xa0 && b1 <= 0xdf)
 			continue;
 		for (int b2 = 0x40; b2 <= 0xff; b2++) {
-			if (u == s2u[b1 - 0x80][b2 - 0x40])
-				return b1 << 8 | b2;
+			uint16_t u = s2u[b1 - 0x80][b2 - 0x40];
+			if (!u2s[u])
+				u2s[u] = b1 << 8 | b2;
 		}
 	}
-	return 0;
+}
+
+static int unicode_to_sjis(int u) {
+	if (u < 0 || u > 0xffff)
+		return 0;
+	pthread_once(&u2s_once, u2s_init);
+	return u2s[u];
 }
 
 char *utf2sjis(const char *_src, size_t len) {
@@ -20,10 +20,12 @@
 
 #include "system4.h"
 #include "system4/ald.h"
+#include "system4/buffer.h"
 #include "system4/cg.h"
 #include "system4/file.h"
 #include "system4/webp.h"
 
+#include "cg_decoder.h"
 #include "little_endian.h"
 
 bool webp_checkfmt(const uint8_t *data)
@@ -71,12 +73,13 @@ static int get_base_cg(uint8_t *data, size_t size)
 	return LittleEndian_getDW(data, 8);
 }
 
-void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
+/*
+ * Fill the pixels masked with the alpha colour (magenta) from the base CG, if
+ * there is one. `pixels` are RGBA, or BGRA if `bgr` is set.
+ */
+static void webp_apply_base_cg(uint8_t *data, size_t size, uint8_t *pixels, size_t stride,
+		int w, int h, bool bgr, struct archive *ar)
 {
-	cg->pixels = WebPDecodeRGBA(data, size, &cg->metrics.w, &cg->metrics.h);
-	webp_init_metrics(&cg->metrics);
-	cg->type = ALCG_WEBP;
-
 	if (!ar)
 		return;
 
@@ -84,35 +87,183 @@ void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
 	if (base < 0)
 		return;
 
-	// FIXME: possible infinite recursion on broken/malicious ALD
-	struct cg *base_cg = cg_load(ar, base-1);
+	struct cg *base_cg = _cg_load_base(ar, base-1);
 	if (!base_cg) {
 		WARNING("failed to load webp base CG");
 		return;
 	}
-	if (base_cg->metrics.w != cg->metrics.w || base_cg->metrics.h != cg->metrics.h) {
+	if (base_cg->metrics.w != w || base_cg->metrics.h != h) {
 		WARNING("webp base CG dimensions don't match: (%d,%d) / (%d,%d)",
-		        base_cg->metrics.w, base_cg->metrics.h, cg->metrics.w, cg->metrics.h);
-		cg_free(base_cg);
+		        base_cg->metrics.w, base_cg->metrics.h, w, h);
+		_cg_release_base(ar, base-1, base_cg);
 		return;
 	}
 
 	// mask alpha color
-	uint8_t *pixels = cg->pixels;
 	uint8_t *base_pixels = base_cg->pixels;
-	for (int row = 0; row < cg->metrics.h; row++) {
-		for (int x = 0; x < cg->metrics.w; x++) {
-			int p = cg->metrics.w*row*4 + x*4;
-			if (pixels[p] == 255 && pixels[p+1] == 0 && pixels[p+2] == 255) {
-				pixels[p+0] = base_pixels[p+0];
-				pixels[p+1] = base_pixels[p+1];
-				pixels[p+2] = base_pixels[p+2];
-				pixels[p+3] = base_pixels[p+3];
+	const int r = bgr ? 2 : 0;
+	for (int row = 0; row < h; row++) {
+		uint8_t *p = pixels + row * stride;
+		uint8_t *b = base_pixels + row * w * 4;
+		for (int x = 0; x < w; x++, p += 4, b += 4) {
+			if (p[0] == 255 && p[1] == 0 && p[2] == 255) {
+				p[r] = b[0];
+				p[1] = b[1];
+				p[2-r] = b[2];
+				p[3] = b[3];
 			}
 		}
 	}
 
-	cg_free(base_cg);
+	_cg_release_base(ar, base-1, base_cg);
+}
+
+void webp_extract(uint8_t *data, size_t size, struct cg *cg, struct archive *ar)
+{
+	cg->pixels = WebPDecodeRGBA(data, size, &cg->metrics.w, &cg->metrics.h);
+	webp_init_metrics(&cg->metrics);
+	cg->type = ALCG_WEBP;
+	if (!cg->pixels)
+		return;
+
+	// without an alpha channel (or a base CG to take it from) it's opaque;
+	// otherwise libwebp decodes the whole image at once, and the alpha
+	// statistics are left to cg_get_alpha_info
+	WebPBitstreamFeatures features;
+	if (ar && get_base_cg(data, size) >= 0)
+		webp_apply_base_cg(data, size, cg->pixels, cg->metrics.w * 4, cg->metrics.w, cg->metrics.h,
+				false, ar);
+	else if (WebPGetFeatures(data, size, &features) == VP8_STATUS_OK && !features.has_alpha)
+		cg_set_opaque(cg);
+}
+
+/*
+ * Decode a WebP scaled to fit in max_w*max_h (see cg_get_scaled_size).
+ */
+void webp_extract_scaled(uint8_t *data, size_t size, struct cg *cg, struct archive *ar,
+		int max_w, int max_h)
+{
+	// masking against the base CG is done at full size
+	if (ar && get_base_cg(data, size) >= 0) {
+		webp_extract(data, size, cg, ar);
+		return;
+	}
+
+	WebPDecoderConfig config;
+	if (!WebPInitDecoderConfig(&config)) {
+		WARNING("WebPInitDecoderConfig failed");
+		return;
+	}
+	if (WebPGetFeatures(data, size, &config.input) != VP8_STATUS_OK) {
+		WARNING("WebPGetFeatures failed");
+		return;
+	}
+
+	int w, h;
+	cg_get_scaled_size(config.input.width, config.input.height, max_w, max_h, &w, &h);
+	if (w != config.input.width || h != config.input.height) {
+		config.options.use_scaling = 1;
+		config.options.scaled_width = w;
+		config.options.scaled_height = h;
+	}
+	uint8_t *pixels = xmalloc((size_t)w * h * 4);
+	config.output.colorspace = MODE_RGBA;
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = pixels;
+	config.output.u.RGBA.stride = w * 4;
+	config.output.u.RGBA.size = (size_t)w * h * 4;
+	if (WebPDecode(data, size, &config) != VP8_STATUS_OK) {
+		WARNING("WebPDecode failed");
+		free(pixels);
+		return;
+	}
+
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	webp_init_metrics(&cg->metrics);
+	cg->type = ALCG_WEBP;
+	cg->pixels = pixels;
+	if (!config.input.has_alpha)
+		cg_set_opaque(cg);
+}
+
+/*
+ * Extract the region (x, y, w, h) of a WebP, which must lie within the image.
+ */
+void webp_extract_rect(uint8_t *data, size_t size, struct cg *cg, struct archive *ar,
+		int x, int y, int w, int h)
+{
+	// masking against the base CG is done at full size
+	if (ar && get_base_cg(data, size) >= 0) {
+		webp_extract(data, size, cg, ar);
+		if (cg->pixels)
+			cg_crop(cg, x, y, w, h);
+		return;
+	}
+
+	WebPDecoderConfig config;
+	if (!WebPInitDecoderConfig(&config)) {
+		WARNING("WebPInitDecoderConfig failed");
+		return;
+	}
+	if (WebPGetFeatures(data, size, &config.input) != VP8_STATUS_OK) {
+		WARNING("WebPGetFeatures failed");
+		return;
+	}
+
+	// Lossy WebP upsamples chroma from neighbouring pixels, so decode with a
+	// small border (and an even origin) to get the same pixels as a full
+	// decode.
+	int x0 = max(x - 2, 0) & ~1;
+	int y0 = max(y - 2, 0) & ~1;
+	int x1 = min(x + w + 2, config.input.width);
+	int y1 = min(y + h + 2, config.input.height);
+	int dw = x1 - x0, dh = y1 - y0;
+	uint8_t *tmp = xmalloc((size_t)dw * dh * 4);
+	config.options.use_cropping = 1;
+	config.options.crop_left = x0;
+	config.options.crop_top = y0;
+	config.options.crop_width = dw;
+	config.options.crop_height = dh;
+	config.output.colorspace = MODE_RGBA;
+	config.output.is_external_memory = 1;
+	config.output.u.RGBA.rgba = tmp;
+	config.output.u.RGBA.stride = dw * 4;
+	config.output.u.RGBA.size = (size_t)dw * dh * 4;
+	if (WebPDecode(data, size, &config) != VP8_STATUS_OK) {
+		WARNING("WebPDecode failed");
+		free(tmp);
+		return;
+	}
+
+	uint8_t *pixels = xmalloc((size_t)w * h * 4);
+	for (int row = 0; row < h; row++) {
+		memcpy(pixels + (size_t)row * w * 4, tmp + ((size_t)(y - y0 + row) * dw + (x - x0)) * 4, w * 4);
+	}
+	free(tmp);
+	cg->metrics.w = w;
+	cg->metrics.h = h;
+	webp_init_metrics(&cg->metrics);
+	cg->type = ALCG_WEBP;
+	cg->pixels = pixels;
+	if (!config.input.has_alpha)
+		cg_set_opaque(cg);
+}
+
+bool webp_extract_into(uint8_t *data, size_t size, uint8_t *dst, size_t stride, bool bgr,
+		struct archive *ar)
+{
+	int w, h;
+	if (!WebPGetInfo(data, size, &w, &h))
+		return false;
+	uint8_t *r = bgr ? WebPDecodeBGRAInto(data, size, dst, stride * h, stride)
+		: WebPDecodeRGBAInto(data, size, dst, stride * h, stride);
+	if (!r) {
+		WARNING("WebPDecode%sInto failed", bgr ? "BGRA" : "RGBA");
+		return false;
+	}
+	webp_apply_base_cg(data, size, dst, stride, w, h, bgr, ar);
+	return true;
 }
 
 #include <stdio.h>
@@ -124,14 +275,32 @@ int webp_write(struct cg *cg, FILE *f)
 {
 	uint8_t *out;
 	size_t len = WebPEncodeLosslessRGBA(cg->pixels, cg->metrics.w, cg->metrics.h, cg->metrics.w*4, &out);
+	if (!len) {
+		WARNING("WebPEncodeLosslessRGBA failed");
+		return 0;
+	}
 	if (fwrite(out, len, 1, f) != 1) {
 		WARNING("webp_write: %s", strerror(errno));
+		WebPFree(out);
 		return 0;
 	}
 	WebPFree(out);
 	return 1;
 }
 
+int webp_encode(struct cg *cg, struct buffer *out)
+{
+	uint8_t *data;
+	size_t len = WebPEncodeLosslessRGBA(cg->pixels, cg->metrics.w, cg->metrics.h, cg->metrics.w*4, &data);
+	if (!len) {
+		WARNING("WebPEncodeLosslessRGBA failed");
+		return 0;
+	}
+	buffer_write_bytes(out, data, len);
+	WebPFree(data);
+	return 1;
+}
+
 void webp_save(const char *path, uint8_t *pixels, int w, int h, bool alpha)
 {
 	size_t len;